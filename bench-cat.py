@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+
+# Measures throughput of `cat` and `tee` builtins against coreutils on a big
+# file. Each command line is run by the shell with `-c`, so the only difference
+# is whether data goes through a separate process and user space or not.
+
+import os
+import subprocess
+import sys
+import time
+from tempfile import TemporaryDirectory
+
+
+CASES = [
+    ('file to file', 'cat {src} > {dst}'),
+    ('file to pipe', 'cat {src} | {cat} > /dev/null'),
+    ('pipe to pipe', 'cat {src} | cat | {cat} > /dev/null'),
+    ('tee to file', 'cat {src} | tee {dst} | {cat} > /dev/null'),
+]
+
+
+def mkfile(path, size):
+    block = os.urandom(1 << 20)
+    with open(path, 'wb') as f:
+        for _ in range(size // len(block)):
+            f.write(block)
+
+
+def run(line, dst=None):
+    # Writing over a file takes longer than writing a new one.
+    if dst and os.path.exists(dst):
+        os.unlink(dst)
+    start = time.monotonic()
+    subprocess.run(['./shell', '-c', line], check=True)
+    return time.monotonic() - start
+
+
+if __name__ == '__main__':
+    os.environ['PATH'] = '/usr/bin:/bin'
+    os.environ['LC_ALL'] = 'C'
+
+    gib = float(sys.argv[1]) if len(sys.argv) > 1 else 2
+    size = int(gib * (1 << 30))
+
+    with TemporaryDirectory(dir='.') as tmp:
+        src = os.path.join(tmp, 'src')
+        dst = os.path.join(tmp, 'dst')
+        mkfile(src, size)
+        # Warm up page cache, so both variants read from memory.
+        run(f'/bin/cat {src} > /dev/null')
+
+        for name, line in CASES:
+            # Builtins are always used by the shell, unless given by path.
+            coreutils = line.replace('cat ', '/bin/cat ').replace(
+                'tee ', '/usr/bin/tee ')
+            builtin = run(line.format(src=src, dst=dst, cat='/bin/cat'), dst)
+            external = run(coreutils.format(src=src, dst=dst, cat='/bin/cat'),
+                           dst)
+            print(f'{name:12} builtin {size / builtin / 1e6:8.0f} MB/s, '
+                  f'coreutils {size / external / 1e6:8.0f} MB/s '
+                  f'({external / builtin:.1f}x)')
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+
+# Measures throughput of `wc` and `grep -c` builtins against coreutils on a big
+# text file, and checks both print the same. Each command line is run by the
+# shell with `-c`, so the only difference is whether a process is started and
+# how text is scanned.
+
+import os
+import random
+import subprocess
+import sys
+import time
+from tempfile import TemporaryDirectory
+
+
+CASES = [
+    ('lines', 'wc -l {src}'),
+    ('all counts', 'wc {src}'),
+    ('fixed string', 'grep -c -F needle {src}'),
+    ('pipe lines', 'cat {src} | wc -l'),
+]
+
+WORDS = ['a', 'the', 'queue', 'LIST_ENTRY', 'needle', 'x' * 40, '\t', '  ']
+
+
+def mkfile(path, size):
+    random.seed(1)
+    lines = [' '.join(random.choices(WORDS, k=random.randrange(16))) + '\n'
+             for _ in range(4096)]
+    block = ''.join(lines).encode()
+    with open(path, 'wb') as f:
+        for _ in range(size // len(block)):
+            f.write(block)
+
+
+def run(line):
+    start = time.monotonic()
+    out = subprocess.run(['./shell', '-c', line], check=True,
+                         stdout=subprocess.PIPE).stdout
+    return time.monotonic() - start, out
+
+
+if __name__ == '__main__':
+    os.environ['PATH'] = '/usr/bin:/bin'
+    os.environ['LC_ALL'] = 'C'
+
+    gib = float(sys.argv[1]) if len(sys.argv) > 1 else 1
+    size = int(gib * (1 << 30))
+
+    with TemporaryDirectory(dir='.') as tmp:
+        src = os.path.join(tmp, 'src')
+        mkfile(src, size)
+        # Warm up page cache, so both variants read from memory.
+        run(f'/bin/cat {src} > /dev/null')
+
+        for name, line in CASES:
+            # Builtins are always used by the shell, unless given by path.
+            coreutils = line.replace('wc ', '/usr/bin/wc ').replace(
+                'grep ', '/bin/grep ')
+            builtin, expected = run(line.format(src=src))
+            external, out = run(coreutils.format(src=src))
+            if out != expected:
+                sys.exit(f'{name}: builtin printed {expected!r}, '
+                         f'coreutils {out!r}')
+            print(f'{name:12} builtin {size / builtin / 1e6:8.0f} MB/s, '
+                  f'coreutils {size / external / 1e6:8.0f} MB/s '
+                  f'({external / builtin:.1f}x)')
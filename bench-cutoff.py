@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+
+# Measures CPU time wasted by a producer that goes on computing after the
+# reader of its output has finished, with each `cutoff` policy. Time is taken
+# from resource usage of the shell and all of its subprocesses.
+
+import os
+import resource
+import subprocess
+import sys
+from tempfile import TemporaryDirectory
+
+
+POLICIES = ['off', 'PIPE', 'TERM']
+
+# Writes a line and then computes for a while, just like a command that
+# prints a header and then sorts or compresses its input.
+PRODUCER = '''echo header
+i=0
+while [ $i -lt {n} ]; do i=$((i+1)); done
+echo done
+'''
+
+LINE = 'cutoff {policy}; /bin/sh {script} | head -1 > /dev/null'
+
+
+def cputime():
+    ru = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return ru.ru_utime + ru.ru_stime
+
+
+def run(line):
+    before = cputime()
+    subprocess.run(['./shell', '-c', line], check=True)
+    return cputime() - before
+
+
+if __name__ == '__main__':
+    os.environ['PATH'] = '/usr/bin:/bin'
+
+    n = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+
+    with TemporaryDirectory(dir='.') as tmp:
+        script = os.path.join(tmp, 'producer.sh')
+        with open(script, 'w') as f:
+            f.write(PRODUCER.format(n=n))
+
+        wasted = None
+        for policy in POLICIES:
+            elapsed = run(LINE.format(policy=policy, script=script))
+            if wasted is None:
+                wasted = elapsed
+            print(f'cutoff {policy:4} {elapsed:7.3f}s of CPU time, '
+                  f'{wasted - elapsed:7.3f}s avoided')
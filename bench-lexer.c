@@ -0,0 +1,136 @@
+#include "shell.h"
+
+/* Feeds synthetic command lines through the scalar tokenizer and vectorized
+ * ones, checks they split lines into the same tokens and measures their
+ * throughput. */
+
+static const char *isas[] = {"scalar", "sse2", "avx2", NULL};
+
+/* Pieces synthetic command lines are made of. */
+static const char *pieces[] = {
+  " ", "  ", "\t", " \t\n ", "|", "||", "&", "&&", "<", ">", ">>", ";", "!",
+  "ls", "-l", "--color=auto", "/usr/include/queue.h", "x", "\x80\xff",
+  "generated/file/name/with/a/really/long/path/that/spans/vectors.c",
+};
+
+#define NPIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+static char *mkline(unsigned seed, size_t len) {
+  char *line = Malloc(len + 1);
+  size_t n = 0;
+
+  srandom(seed);
+  while (n < len) {
+    const char *p = pieces[random() % NPIECES];
+    size_t l = min(strlen(p), len - n);
+    memcpy(line + n, p, l);
+    n += l;
+  }
+  line[len] = '\0';
+  return line;
+}
+
+/* Command line as produced by build tools: many long arguments. */
+static char *mkfiles(size_t len) {
+  char *line = Malloc(len + 1);
+  size_t n = snprintf(line, len + 1, "cc -c");
+
+  for (int i = 0; n < len; i++)
+    n += snprintf(line + n, len + 1 - n, " src/module%02d/generated_%05d.c",
+                  i % 37, i);
+  line[len] = '\0';
+  return line;
+}
+
+static bool same(token_t *ta, int na, token_t *tb, int nb) {
+  if (na != nb)
+    return false;
+  for (int i = 0; i <= na; i++) {
+    if (ta[i].kind != tb[i].kind || ta[i].offset != tb[i].offset ||
+        ta[i].length != tb[i].length)
+      return false;
+  }
+  return true;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(const char *what, const char *orig, int nlines,
+                  arena_t *arena) {
+  size_t len = strlen(orig);
+
+  for (const char **isa = isas; *isa; isa++) {
+    if (!uselexer(*isa)) {
+      printf("%-6s %-8s not supported\n", what, *isa);
+      continue;
+    }
+
+    double start = now();
+    for (int i = 0; i < nlines; i++) {
+      int n;
+      (void)tokenize(orig, &n, arena);
+      arena_reset(arena);
+    }
+    double t = now() - start;
+
+    printf("%-6s %-8s %8.1f MB/s\n", what, *isa, nlines * len / t / 1e6);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static const size_t lens[] = {0, 1, 15, 31, 64, 1000, MAXLINE - 1, 65536};
+  int nlines = 1000;
+  arena_t arena = {};
+  int rc = EXIT_SUCCESS;
+
+  /* Vary alignment of lines too, since scanners load aligned blocks. */
+  for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+    for (int seed = 0; seed < 64; seed++) {
+      char *orig = mkline(seed, lens[i]);
+      char *buf = Malloc(lens[i] + 33);
+      char *line = strcpy(buf + seed % 32, orig);
+      int nref, n;
+
+      uselexer("scalar");
+      token_t *tref = tokenize(line, &nref, &arena);
+
+      for (const char **isa = isas; *isa; isa++) {
+        if (!uselexer(*isa))
+          continue;
+        token_t *t = tokenize(line, &n, &arena);
+        if (!same(tref, nref, t, n) || strcmp(line, orig)) {
+          printf("%s: tokens differ for line of %zu chars (seed %d)\n", *isa,
+                 lens[i], seed);
+          rc = EXIT_FAILURE;
+        }
+      }
+
+      arena_reset(&arena);
+      free(orig);
+      free(buf);
+    }
+  }
+
+  if (rc != EXIT_SUCCESS)
+    return rc;
+
+  if (argc > 1)
+    nlines = atoi(argv[1]);
+
+  /* Throughput is measured on lines of maximum length shell accepts: a mix of
+   * short tokens and operators, and a long list of generated file names. */
+  char *mixed = mkline(1, MAXLINE - 1);
+  char *files = mkfiles(MAXLINE - 1);
+
+  bench("mixed", mixed, nlines, &arena);
+  bench("files", files, nlines, &arena);
+
+  free(mixed);
+  free(files);
+  arena_free(&arena);
+  return rc;
+}
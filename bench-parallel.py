@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+
+# Compares `parallel` builtin with `xargs -P` started by the shell, running
+# a short command for each of many items with the same number of slots.
+
+import os
+import subprocess
+import sys
+import time
+from tempfile import TemporaryDirectory
+
+
+LINES = {
+    'xargs': '/usr/bin/xargs -n 1 -P {n} /bin/true < {items}',
+    'parallel': 'parallel -P {n} -a {items} /bin/true',
+}
+
+
+def run(line):
+    start = time.monotonic()
+    p = subprocess.run(['./shell', '-c', line], check=True,
+                       stderr=subprocess.PIPE, text=True)
+    return time.monotonic() - start, p.stderr.strip()
+
+
+if __name__ == '__main__':
+    os.environ['PATH'] = '/usr/bin:/bin'
+
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 5000
+    n = os.cpu_count()
+
+    with TemporaryDirectory(dir='.') as tmp:
+        items = os.path.join(tmp, 'items')
+        with open(items, 'w') as f:
+            f.writelines(f'{i}\n' for i in range(count))
+
+        for name, line in LINES.items():
+            elapsed, report = run(line.format(n=n, items=items))
+            print(f'{name:8} {count} tasks, {n} at once: {elapsed:6.3f}s, '
+                  f'{count / elapsed:8.1f} tasks/s')
+            if report:
+                print(f'         {report}')
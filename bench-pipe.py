@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+
+# Measures how capacity of pipes, set with `pipesize` builtin, affects a
+# pipeline of external commands moving a big file. Bigger pipes let writers
+# fill them up for longer before readers have to run, hence fewer context
+# switches. Those are counted for the shell and all of its subprocesses.
+
+import os
+import resource
+import subprocess
+import sys
+import time
+from tempfile import TemporaryDirectory
+
+
+SIZES = ['0', '256k', '1M']
+
+LINE = 'pipesize {size} /bin/cat {src} | /bin/cat | /bin/cat > /dev/null'
+
+
+def mkfile(path, size):
+    block = os.urandom(1 << 20)
+    with open(path, 'wb') as f:
+        for _ in range(size // len(block)):
+            f.write(block)
+
+
+def switches():
+    ru = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return ru.ru_nvcsw + ru.ru_nivcsw
+
+
+def run(line):
+    before = switches()
+    start = time.monotonic()
+    subprocess.run(['./shell', '-c', line], check=True)
+    return time.monotonic() - start, switches() - before
+
+
+if __name__ == '__main__':
+    os.environ['PATH'] = '/usr/bin:/bin'
+
+    gib = float(sys.argv[1]) if len(sys.argv) > 1 else 1
+    size = int(gib * (1 << 30))
+
+    with TemporaryDirectory(dir='.') as tmp:
+        src = os.path.join(tmp, 'src')
+        mkfile(src, size)
+        # Warm up page cache, so all variants read from memory.
+        run(f'/bin/cat {src} > /dev/null')
+
+        for pipesize in SIZES:
+            elapsed, nswitches = run(LINE.format(size=pipesize, src=src))
+            name = 'default' if pipesize == '0' else pipesize
+            print(f'pipesize {name:8} {size / elapsed / 1e6:8.0f} MB/s, '
+                  f'{nswitches:8} context switches')
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+
+# Runs the same command lines from a script and interactively (typed into
+# a pseudo-terminal one by one) and compares how fast they're executed.
+
+import os
+import pexpect
+import subprocess
+import sys
+import time
+from tempfile import NamedTemporaryFile
+
+
+WORKLOADS = {
+    'builtin': ['cd .', 'set -o', 'hash'],
+    'external': ['true', 'true | true', 'echo x > /dev/null'],
+}
+
+
+def run_script(lines):
+    with NamedTemporaryFile(mode='w', suffix='.sh') as script:
+        script.write('\n'.join(lines) + '\n')
+        script.flush()
+        start = time.monotonic()
+        subprocess.run(['./shell', script.name], stdout=subprocess.DEVNULL,
+                       check=True)
+        return time.monotonic() - start
+
+
+def run_interactive(lines):
+    child = pexpect.spawn('./shell', timeout=30)
+    child.delaybeforesend = None
+    child.setecho(False)
+    child.expect_exact('# ')
+    start = time.monotonic()
+    for line in lines:
+        child.sendline(line)
+        child.expect_exact('# ')
+    elapsed = time.monotonic() - start
+    child.sendline('quit')
+    child.expect(pexpect.EOF)
+    return elapsed
+
+
+if __name__ == '__main__':
+    os.environ['PATH'] = '/usr/bin:/bin'
+    os.environ['LC_ALL'] = 'C'
+
+    n = int(sys.argv[1]) if len(sys.argv) > 1 else 600
+
+    for name, cmds in WORKLOADS.items():
+        lines = [cmds[i % len(cmds)] for i in range(n)]
+        script = run_script(lines)
+        interactive = run_interactive(lines)
+        print(f'{name:8} script {n / script:8.0f} lines/s, '
+              f'interactive {n / interactive:8.0f} lines/s '
+              f'({interactive / script:.1f}x)')
@@ -5,6 +5,10 @@ typedef int (*func_t)(char **argv);
 typedef struct {
   const char *name;
   func_t func;
+  pipemode_t pipemode;
+  /* Tells if the builtin handles given arguments, otherwise external command
+   * of the same name is used. NULL if it handles all of them. */
+  bool (*accepts)(char **argv);
 } command_t;
 
 static int do_quit(char **argv) {
@@ -31,9 +35,20 @@ static int do_chdir(char **argv) {
 
 /*
  * Displays all stopped or running jobs.
+ * 'jobs' - one line per job
+ * 'jobs -l' - also list processes of each job with their pids
  */
 static int do_jobs(char **argv) {
-  watchjobs(ALL);
+  bool procs = false;
+  if (argv[0] && !strcmp(argv[0], "-l")) {
+    procs = true;
+    argv++;
+  }
+  if (argv[0]) {
+    msg("jobs: usage: jobs [-l]\n");
+    return 1;
+  }
+  watchjobs(ALL, procs);
   return 0;
 }
 
@@ -61,11 +76,9 @@ static int do_fg(char **argv) {
 static int do_bg(char **argv) {
   int j = argv[0] ? atoi(argv[0]) : -1;
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, BG, &mask))
+  /* Job stays in background, so there's no need to wait for SIGCHLD. */
+  if (!resumejob(j, BG, NULL))
     msg("bg: job not found: %s\n", argv[0]);
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
 
@@ -75,65 +88,326 @@ static int do_bg(char **argv) {
  * 'bg n' choose job number n
  */
 static int do_kill(char **argv) {
-  if (!argv[0])
-    return -1;
-  if (*argv[0] != '%')
-    return -1;
-
   int j = atoi(argv[0] + 1);
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
   if (!killjob(j))
     msg("kill: job not found: %s\n", argv[0]);
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
 
   return 0;
 }
 
-static command_t builtins[] = {
-  {"quit", do_quit}, {"cd", do_chdir},  {"jobs", do_jobs}, {"fg", do_fg},
-  {"bg", do_bg},     {"kill", do_kill}, {NULL, NULL},
+/* Only jobs are killed by the builtin, processes are left to kill(1). */
+static bool kill_accepts(char **argv) {
+  return argv[0] != NULL && argv[0][0] == '%';
+}
+
+typedef struct {
+  const char *name;
+  bool *value;
+} option_t;
+
+static option_t options[] = {
+  {"pathfd", &opt_pathfd},
+  {"rewrite", &opt_rewrite},
+  {"rewritelog", &opt_rewritelog},
+  {"spawn", &opt_spawn},
+  {NULL, NULL},
 };
 
-int builtin_command(char **argv) {
-  for (command_t *cmd = builtins; cmd->name; cmd++) {
-    if (strcmp(argv[0], cmd->name))
+/*
+ * Display or change shell options.
+ * 'set -o' - list all options and their values
+ * 'set -o name' - turn on option
+ * 'set +o name' - turn off option
+ */
+static int do_set(char **argv) {
+  if (argv[0] == NULL || (!strcmp(argv[0], "-o") && argv[1] == NULL)) {
+    for (option_t *opt = options; opt->name; opt++)
+      printf("%-15s %s\n", opt->name, *opt->value ? "on" : "off");
+    return 0;
+  }
+
+  if ((strcmp(argv[0], "-o") && strcmp(argv[0], "+o")) || argv[1] == NULL) {
+    msg("set: usage: set [-o|+o] [option]\n");
+    return 1;
+  }
+
+  for (option_t *opt = options; opt->name; opt++) {
+    if (strcmp(argv[1], opt->name))
       continue;
-    return cmd->func(&argv[1]);
+    *opt->value = argv[0][0] == '-';
+    return 0;
+  }
+
+  msg("set: %s: invalid option name\n", argv[1]);
+  return 1;
+}
+
+/* Parse size given in bytes, or in KiB or MiB with `k` or `M` suffix. */
+static bool parsesize(const char *s, size_t *sizep) {
+  char *end;
+  errno = 0;
+  unsigned long size = strtoul(s, &end, 10);
+  if (errno || end == s || *s == '-')
+    return false;
+  if (*end == 'k' || *end == 'K')
+    size <<= 10, end++;
+  else if (*end == 'm' || *end == 'M')
+    size <<= 20, end++;
+  if (*end != '\0' || size > INT_MAX)
+    return false;
+  *sizep = size;
+  return true;
+}
+
+int pipesize_prefix(char **argv, size_t *sizep) {
+  if (strcmp(argv[0], "pipesize") || argv[1] == NULL || argv[2] == NULL)
+    return 0;
+  return parsesize(argv[1], sizep) ? 2 : 0;
+}
+
+/*
+ * Display or change capacity of pipes that connect commands.
+ * 'pipesize' - display capacity of new pipes, 0 is kernel's default
+ * 'pipesize size' - set capacity of new pipes (e.g. 256k or 1M)
+ * 'pipesize size cmd ...' - set capacity of pipes of pipeline started by cmd
+ */
+static int do_pipesize(char **argv) {
+  if (argv[0] == NULL) {
+    printf("%zu\n", opt_pipesize);
+    return 0;
+  }
+
+  /* Prefix of a pipeline is stripped before it's run, see `pipesize_prefix`. */
+  if (argv[1] != NULL) {
+    msg("pipesize: usage: pipesize [size [command ...]]\n");
+    return 1;
   }
 
-  errno = ENOENT;
-  return -1;
+  if (!parsesize(argv[0], &opt_pipesize)) {
+    msg("pipesize: %s: invalid size\n", argv[0]);
+    return 1;
+  }
+  return 0;
 }
 
-noreturn void external_command(char **argv) {
-  const char *path = getenv("PATH");
+static const struct {
+  const char *name;
+  int sig;
+} cutoffs[] = {
+  {"off", 0}, {"PIPE", SIGPIPE}, {"TERM", SIGTERM}, {"KILL", SIGKILL},
+  {NULL, 0},
+};
+
+/*
+ * Display or change signal that processes of a pipeline get, once a process
+ * downstream has finished and nobody reads what they write.
+ * 'cutoff' - display signal for new jobs
+ * 'cutoff sig' - set signal for new jobs (`PIPE`, `TERM`, `KILL` or `off`)
+ * 'cutoff sig %n' - set signal for job number n
+ */
+static int do_cutoff(char **argv) {
+  if (argv[0] == NULL) {
+    for (int i = 0; cutoffs[i].name; i++)
+      if (cutoffs[i].sig == opt_cutoff)
+        printf("%s\n", cutoffs[i].name);
+    return 0;
+  }
+
+  if (argv[1] != NULL && (argv[1][0] != '%' || argv[2] != NULL)) {
+    msg("cutoff: usage: cutoff [sig [%%n]]\n");
+    return 1;
+  }
 
-  if (!index(argv[0], '/') && path) {
-    /* TODO: For all paths in PATH construct an absolute path and execve it. */
-#ifdef STUDENT
+  int i = 0;
+  while (cutoffs[i].name && strcmp(argv[0], cutoffs[i].name))
+    i++;
+  if (cutoffs[i].name == NULL) {
+    msg("cutoff: %s: invalid signal\n", argv[0]);
+    return 1;
+  }
 
-    while (1) {
-      int tosep = strcspn(path, ":");
-      char *str = strndup(path, tosep);
-      strapp(&str, "/");
-      strapp(&str, argv[0]);
+  if (argv[1] == NULL) {
+    opt_cutoff = cutoffs[i].sig;
+    return 0;
+  }
 
-      execve(str, argv, environ);
-      free(str);
-      if (!path[tosep]) {
-        // hit end of str
-        break;
-      }
-      path = path + tosep + 1;
+  if (!cutoffjob(atoi(argv[1] + 1), cutoffs[i].sig)) {
+    msg("cutoff: job not found: %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Display or change how many background jobs may run at once. Jobs over the
+ * limit wait in a queue and start in order as running ones finish.
+ * 'bglimit' - display the limit and number of running and queued jobs
+ * 'bglimit n' - let at most n jobs run, 0 or `off` means no limit
+ * 'bglimit cpu' - let as many jobs run as there are CPUs
+ * 'bglimit pressure' - like `cpu`, but hold jobs back while CPU is contended
+ */
+static int do_bglimit(char **argv) {
+  if (argv[0] == NULL) {
+    printbglimit();
+    return 0;
+  }
+
+  if (argv[1] != NULL) {
+    msg("bglimit: usage: bglimit [n|off|cpu|pressure]\n");
+    return 1;
+  }
+
+  char *end;
+  long n;
+  bool pressure = !strcmp(argv[0], "pressure");
+
+  if (!strcmp(argv[0], "off")) {
+    n = 0;
+  } else if (pressure || !strcmp(argv[0], "cpu")) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  } else if ((n = strtol(argv[0], &end, 10)) < 0 || *end != '\0' ||
+             end == argv[0] || n > INT_MAX) {
+    msg("bglimit: %s: invalid limit\n", argv[0]);
+    return 1;
+  }
+
+  opt_bglimit = n;
+  opt_bgpressure = pressure;
+  return 0;
+}
+
+/*
+ * Remember or display locations of commands found in PATH.
+ * 'hash' - display remembered commands
+ * 'hash -r' - forget all remembered commands
+ * 'hash name ...' - search PATH for commands and remember them
+ */
+static int do_hash(char **argv) {
+  if (argv[0] == NULL) {
+    printcmds();
+    return 0;
+  }
+
+  if (!strcmp(argv[0], "-r")) {
+    flushcmds();
+    return 0;
+  }
+
+  int rc = 0;
+  for (; *argv; argv++) {
+    if (!findcmd(*argv)) {
+      msg("hash: %s: %s\n", *argv, strerror(errno));
+      rc = 1;
     }
+  }
+  return rc;
+}
 
-#endif /* !STUDENT */
-  } else {
-    (void)execve(argv[0], argv, environ);
+/*
+ * Display statistics of shell's caches.
+ * 'stats' - parsed command line cache hits and misses, processes cut off
+ */
+static int do_stats(char **argv) {
+  printparsecache();
+  printcutoffs();
+  return 0;
+}
+
+/*
+ * Replace the shell with an external command.
+ * 'exec' - do nothing
+ * 'exec cmd args...' - execute cmd in place of the shell
+ */
+static int do_exec(char **argv) {
+  if (argv[0] == NULL)
+    return 0;
+
+  cmdent_t *cmd = findcmd(argv[0]);
+  if (cmd == NULL) {
+    int rc = errno == ENOENT ? 127 : 126;
+    msg("exec: %s: %s\n", argv[0], strerror(errno));
+    /* Script must not go on as if the command had run in its place. */
+    if (!interactive)
+      exit(rc);
+    return rc;
+  }
+
+  replace_shell(cmd, argv);
+}
+
+/* Builtins that change the state of the shell (e.g. current directory) must
+ * not run in-process when they're a part of a pipeline, since other shells run
+ * them in a subshell. */
+static command_t builtins[] = {
+  {"quit", do_quit, SUBSHELL},  {"cd", do_chdir, SUBSHELL},
+  {"jobs", do_jobs, CAPTURE},   {"fg", do_fg, SUBSHELL},
+  {"bg", do_bg, SUBSHELL},      {"kill", do_kill, CAPTURE, kill_accepts},
+  {"set", do_set, SUBSHELL},    {"hash", do_hash, CAPTURE},
+  {"stats", do_stats, CAPTURE}, {"exec", do_exec, SUBSHELL},
+  {"pipesize", do_pipesize, SUBSHELL}, {"cutoff", do_cutoff, SUBSHELL},
+  {"cat", do_cat, FILTER, cat_accepts},
+  {"tee", do_tee, FILTER, tee_accepts},
+  {"wc", do_wc, FILTER, wc_accepts},
+  {"grep", do_grep, FILTER, grep_accepts},
+  {"parallel", do_parallel, SUBSHELL},
+  {"dag", do_dag, SUBSHELL},
+  {"bglimit", do_bglimit, SUBSHELL},
+  {NULL, NULL, SUBSHELL},
+};
+
+/* Returns builtin that runs command `argv` or NULL if there's none. */
+static command_t *lookup(char **argv) {
+  for (command_t *cmd = builtins; cmd->name; cmd++) {
+    if (strcmp(argv[0], cmd->name))
+      continue;
+    if (cmd->accepts && !cmd->accepts(&argv[1]))
+      return NULL;
+    return cmd;
   }
+  return NULL;
+}
+
+bool is_builtin(char **argv) {
+  return lookup(argv) != NULL;
+}
+
+pipemode_t builtin_pipemode(char **argv) {
+  command_t *cmd = lookup(argv);
+  return cmd ? cmd->pipemode : SUBSHELL;
+}
+
+int builtin_command(char **argv) {
+  command_t *cmd = lookup(argv);
+  if (cmd == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  /* Output must not be held back when it's not a terminal, since commands
+   * that follow write to the same file directly. */
+  int rc = cmd->func(&argv[1]);
+  fflush(stdout);
+  return rc;
+}
 
+/* Executes command located by `findcmd` in the parent, so the child does not
+ * have to repeat the search. */
+noreturn void external_command(cmdent_t *cmd, char **argv) {
+  execcmd(cmd, argv);
+
+  int rc = errno == ENOENT ? 127 : 126;
   msg("%s: %s\n", argv[0], strerror(errno));
-  exit(EXIT_FAILURE);
+  exit(rc);
+}
+
+/* Executes command in the shell's own process, which saves a fork when there
+ * is nothing left for the shell to do afterwards. Signals ignored by the shell
+ * would stay ignored in the command, so they are restored first. */
+noreturn void replace_shell(cmdent_t *cmd, char **argv) {
+  fflush(stdout);
+  Signal(SIGTSTP, SIG_DFL);
+  Signal(SIGTTIN, SIG_DFL);
+  Signal(SIGTTOU, SIG_DFL);
+  external_command(cmd, argv);
 }
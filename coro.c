@@ -0,0 +1,293 @@
+#include "shell.h"
+#include "queue.h"
+#include <sys/signalfd.h>
+
+/* Coroutines let builtins that are a part of a pipeline run within the shell,
+ * instead of in a copy of the shell made with fork. Switching between them is
+ * done with Setjmp & Longjmp, which do not touch signal mask, so it's just a
+ * matter of saving and restoring a few registers. A coroutine that would block
+ * on a pipe gives way to others, and when none of them can go on, the
+ * scheduler waits for their descriptors with `evready`.
+ *
+ * Subprocesses of the pipeline may be stopped (e.g. with ^Z), while the
+ * coroutines wait for them to read or write. A coroutine cannot be stopped
+ * and moved to background along with them, so the scheduler also waits for
+ * SIGCHLD, and once the job is stopped the coroutines are told to give up:
+ * reads and writes they wait for fail with EINTR, as if they were
+ * interrupted. */
+
+#define STACKSIZE (256 * 1024)
+
+/* AddressSanitizer has to be told the stack is about to change, or it reports
+ * errors that are not there. */
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/common_interface_defs.h>
+#else
+#define __sanitizer_start_switch_fiber(fake_stack_save, bottom, size)
+#define __sanitizer_finish_switch_fiber(fake_stack_save, bottom_old, size_old)
+#endif
+
+typedef enum { READY, WAITING, DONE } costate_t;
+
+typedef struct coro {
+  TAILQ_ENTRY(coro) link;
+  costate_t state;
+  Jmpbuf ctx;         /* registers saved when coroutine gave way */
+  void *stack;        /* STACKSIZE bytes with a guard page at the bottom */
+  void (*func)(void *);
+  void *arg;
+  struct pollfd wait; /* descriptor the coroutine is waiting for */
+  int stdio[2];       /* standard input & output, -1 for shell's own */
+  FILE *out;          /* what stdout is while it runs, NULL for shell's own */
+  void *fake_stack;   /* used by AddressSanitizer */
+} coro_t;
+
+static TAILQ_HEAD(, coro) coros = TAILQ_HEAD_INITIALIZER(coros);
+static int ncoros = 0;       /* number of coroutines that have not finished */
+static coro_t *current;      /* coroutine that is running or NULL */
+static Jmpbuf scheduler;     /* where coroutines return when they give way */
+static void *stacks = NULL;  /* stacks of finished coroutines for reuse */
+static const void *shell_stack; /* bottom of the scheduler's stack */
+static size_t shell_stack_size;
+static void *shell_fake_stack;
+static FILE *shell_stdout;      /* stdout of the shell while coroutines run */
+static int cojob = -1;          /* job coroutines exchange data with or -1 */
+static int sigfd = -1;          /* SIGCHLD while there's such job */
+static bool stopped = false;    /* the job has stopped, coroutines give up */
+
+static void *allocstack(void) {
+  void *stack = stacks;
+  if (stack != NULL) {
+    /* Next free stack is remembered right above the guard page. */
+    stacks = *(void **)((char *)stack + getpagesize());
+    return stack;
+  }
+
+  stack = Mmap(NULL, STACKSIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Mprotect(stack, getpagesize(), PROT_NONE);
+  return stack;
+}
+
+static void freestack(void *stack) {
+  *(void **)((char *)stack + getpagesize()) = stacks;
+  stacks = stack;
+}
+
+/* First code that runs on coroutine's stack. It must not return, since there's
+ * nowhere to return to. */
+static noreturn void trampoline(void) {
+  __sanitizer_finish_switch_fiber(NULL, &shell_stack, &shell_stack_size);
+  current->func(current->arg);
+  current->state = DONE;
+  /* Coroutine's stack is not going to be used anymore. */
+  __sanitizer_start_switch_fiber(NULL, shell_stack, shell_stack_size);
+  Longjmp(scheduler, 1);
+}
+
+/* Create a coroutine that will call `func` with `arg` once `corun` is called.
+ * It reads from `input` and writes to `output` instead of standard input and
+ * output of the shell, unless they're -1, see `cofd`. */
+void cospawn(void (*func)(void *), void *arg, int input, int output) {
+  coro_t *co = Malloc(sizeof(coro_t));
+
+  *co = (coro_t){
+    .state = READY,
+    .func = func,
+    .arg = arg,
+    .stdio = {input, output},
+  };
+  co->stack = allocstack();
+
+  /* Longjmp pops return address from the top of the stack, so the trampoline
+   * is entered with the stack aligned just like after a call instruction. */
+  co->ctx->rsp = (char *)co->stack + STACKSIZE - 16;
+  co->ctx->rip = (void *)trampoline;
+
+  TAILQ_INSERT_TAIL(&coros, co, link);
+  ncoros++;
+}
+
+/* Returns descriptor that stands for standard input or output `fd` of running
+ * coroutine. Outside of coroutines it's `fd` itself. */
+int cofd(int fd) {
+  assert(fd == STDIN_FILENO || fd == STDOUT_FILENO);
+  if (current == NULL || current->stdio[fd] < 0)
+    return fd;
+  return current->stdio[fd];
+}
+
+/* Make stdio print to `out` (or back to shell's stdout if NULL) for as long
+ * as running coroutine runs. Other coroutines may print to their own streams
+ * while it has given way. */
+void costdout(FILE *out) {
+  assert(current != NULL);
+  current->out = out;
+  stdout = out ? out : shell_stdout;
+}
+
+/* Give way to other coroutines until `fd` is ready for `events`. Outside of
+ * coroutines there is nobody to give way to, so just wait. Returns false if
+ * the coroutine has to give up instead, then errno is set to EINTR. */
+bool cowait(int fd, short events) {
+  if (current == NULL) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    evready(&pfd, 1);
+    return true;
+  }
+
+  if (!stopped) {
+    current->wait = (struct pollfd){.fd = fd, .events = events};
+    current->state = WAITING;
+    if (Setjmp(current->ctx) == 0) {
+      __sanitizer_start_switch_fiber(&current->fake_stack, shell_stack,
+                                     shell_stack_size);
+      Longjmp(scheduler, 1);
+    }
+    __sanitizer_finish_switch_fiber(current->fake_stack, NULL, NULL);
+  }
+
+  if (stopped)
+    errno = EINTR;
+  return !stopped;
+}
+
+/* Read from descriptor that may be non-blocking, letting other coroutines run
+ * while there's no data. Returns what read does, never -1 with EAGAIN. */
+ssize_t coread(int fd, void *buf, size_t count) {
+  ssize_t n;
+  while ((n = read(fd, buf, count)) < 0 && errno == EAGAIN)
+    if (!cowait(fd, POLLIN))
+      return -1;
+  return n;
+}
+
+/* Write all `count` bytes, letting other coroutines run while there's no room
+ * for them. Returns -1 if it failed (e.g. with EPIPE). */
+ssize_t cowrite(int fd, const void *buf, size_t count) {
+  for (size_t done = 0; done < count;) {
+    ssize_t n = write(fd, (const char *)buf + done, count - done);
+    if (n >= 0) {
+      done += n;
+    } else if (errno == EAGAIN) {
+      if (!cowait(fd, POLLOUT))
+        return -1;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return count;
+}
+
+/* Some subprocess has changed its state. If that stopped the job, wake up all
+ * coroutines, so that they give up. */
+static void cochild(void) {
+  struct signalfd_siginfo si;
+  coro_t *co;
+
+  while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+    continue;
+
+  childevents();
+  if (!jobstopped(cojob))
+    return;
+
+  stopped = true;
+  TAILQ_FOREACH(co, &coros, link) {
+    if (co->state == WAITING)
+      co->state = READY;
+  }
+}
+
+/* Wait until one of waiting coroutines can go on. */
+static void copoll(void) {
+  struct pollfd fds[ncoros + 1];
+  coro_t *co;
+  int n = 0;
+
+  TAILQ_FOREACH(co, &coros, link) {
+    if (co->state == WAITING)
+      fds[n++] = co->wait;
+  }
+  if (sigfd >= 0)
+    fds[n++] = (struct pollfd){.fd = sigfd, .events = POLLIN};
+
+  evready(fds, n);
+
+  if (sigfd >= 0 && fds[n - 1].revents) {
+    cochild();
+    if (stopped)
+      return;
+  }
+
+  n = 0;
+  TAILQ_FOREACH(co, &coros, link) {
+    if (co->state != WAITING)
+      continue;
+    /* Error or hang up is reported to the coroutine by read or write. */
+    if (fds[n++].revents)
+      co->state = READY;
+  }
+}
+
+/* Run coroutines created with `cospawn` until all of them are finished.
+ * If `job` is not -1, they exchange data with its processes, which must not
+ * be stopped while coroutines wait for them. Must be called with SIGCHLD
+ * blocked. */
+void corun(int job) {
+  if (ncoros == 0)
+    return;
+
+  /* Broken pipe is reported by write, rather than killing the shell. */
+  void (*sigpipe)(int) = Signal(SIGPIPE, SIG_IGN);
+
+  cojob = job;
+  stopped = false;
+  if (job >= 0) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    if ((sigfd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK)) < 0)
+      unix_error("signalfd error");
+  }
+
+  while (ncoros > 0) {
+    bool ran = false;
+    coro_t *co, *next;
+
+    TAILQ_FOREACH_SAFE(co, &coros, link, next) {
+      if (co->state != READY)
+        continue;
+
+      current = co;
+      shell_stdout = stdout;
+      if (co->out)
+        stdout = co->out;
+      if (Setjmp(scheduler) == 0) {
+        __sanitizer_start_switch_fiber(&shell_fake_stack, co->stack, STACKSIZE);
+        Longjmp(co->ctx, 1);
+      }
+      __sanitizer_finish_switch_fiber(shell_fake_stack, NULL, NULL);
+      stdout = shell_stdout;
+      current = NULL;
+      ran = true;
+
+      if (co->state == DONE) {
+        TAILQ_REMOVE(&coros, co, link);
+        freestack(co->stack);
+        free(co);
+        ncoros--;
+      }
+    }
+
+    if (!ran)
+      copoll();
+  }
+
+  if (sigfd >= 0) {
+    (void)close(sigfd);
+    sigfd = -1;
+  }
+  cojob = -1;
+  Signal(SIGPIPE, sigpipe);
+}
@@ -0,0 +1,564 @@
+#include "shell.h"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/* Builtins that count lines, words, bytes and lines containing a fixed string,
+ * which are often what ends a pipeline. Input is read in big chunks and each
+ * chunk is classified 64 bytes at a time by a vectorized counter, chosen just
+ * like scanners of the lexer. Options that builtins don't know are left to
+ * external commands of the same name, see `accepts` in command.c. */
+
+#define CHUNK (256 * 1024)
+
+/* Counting is on the hot path, so make sure it's inlined even with -Og. */
+#define INLINE inline __attribute__((always_inline))
+
+/* Vectorized counters turn 64 bytes of text into bitmaps. Without one text is
+ * counted character by character and strings are searched with memchr. */
+typedef struct counter {
+  const char *isa; /* instruction set used by counter */
+  /* Find newlines and whitespace in 64 bytes at `s`. */
+  void (*classify)(const char *s, uint64_t *newlines, uint64_t *spaces);
+  /* Returns number of newlines in `n` bytes at `s`, a multiple of 64. */
+  size_t (*lines)(const char *s, size_t n);
+  /* Returns bitmap of positions in 64 bytes at `s` where a string of `n`
+   * bytes could be `pat`, since its first and last byte are there. */
+  uint64_t (*candidates)(const char *s, const char *pat, size_t n);
+} counter_t;
+
+#ifdef __SSE2__
+#define AVX2 __attribute__((target("avx2")))
+
+/* Returns mask of whitespace bytes in `v`, i.e. ' ' or in ['\t', '\r']. */
+static INLINE uint32_t spaces_sse2(__m128i v) {
+  __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+  __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t);
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+  return _mm_movemask_epi8(m);
+}
+
+static void classify_sse2(const char *s, uint64_t *newlines,
+                          uint64_t *spaces) {
+  uint64_t nl = 0, sp = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+    nl |= (uint64_t)_mm_movemask_epi8(m) << i;
+    sp |= (uint64_t)spaces_sse2(v) << i;
+  }
+  *newlines = nl;
+  *spaces = sp;
+}
+
+/* Newlines are counted per byte lane and lanes are summed up before any of
+ * them could overflow. */
+static size_t lines_sse2(const char *s, size_t n) {
+  __m128i nl = _mm_set1_epi8('\n');
+  size_t count = 0;
+  while (n > 0) {
+    size_t chunk = n < 255 * 16 ? n : 255 * 16;
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i < chunk; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+    }
+    __m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+    count += _mm_cvtsi128_si64(sum) + _mm_extract_epi16(sum, 4);
+    s += chunk;
+    n -= chunk;
+  }
+  return count;
+}
+
+static uint64_t candidates_sse2(const char *s, const char *pat, size_t n) {
+  __m128i first = _mm_set1_epi8(pat[0]);
+  __m128i last = _mm_set1_epi8(pat[n - 1]);
+  uint64_t found = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + n - 1));
+    __m128i m =
+      _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last));
+    found |= (uint64_t)_mm_movemask_epi8(m) << i;
+  }
+  return found;
+}
+
+AVX2 static INLINE uint32_t spaces_avx2(__m256i v) {
+  __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+  __m256i m =
+    _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t);
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+  return _mm256_movemask_epi8(m);
+}
+
+AVX2 static INLINE uint32_t newlines_avx2(__m256i v) {
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+}
+
+AVX2 static void classify_avx2(const char *s, uint64_t *newlines,
+                               uint64_t *spaces) {
+  __m256i lo = _mm256_loadu_si256((const __m256i *)s);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(s + 32));
+  *newlines = newlines_avx2(lo) | (uint64_t)newlines_avx2(hi) << 32;
+  *spaces = spaces_avx2(lo) | (uint64_t)spaces_avx2(hi) << 32;
+}
+
+AVX2 static size_t lines_avx2(const char *s, size_t n) {
+  __m256i nl = _mm256_set1_epi8('\n');
+  size_t count = 0;
+  while (n > 0) {
+    size_t chunk = n < 255 * 32 ? n : 255 * 32;
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < chunk; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+    }
+    __m256i sum = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+    count += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+             _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+    s += chunk;
+    n -= chunk;
+  }
+  return count;
+}
+
+AVX2 static INLINE uint32_t matches_avx2(const char *s, __m256i first,
+                                         __m256i last, size_t n) {
+  __m256i a = _mm256_loadu_si256((const __m256i *)s);
+  __m256i b = _mm256_loadu_si256((const __m256i *)(s + n - 1));
+  return _mm256_movemask_epi8(
+    _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+}
+
+AVX2 static uint64_t candidates_avx2(const char *s, const char *pat,
+                                     size_t n) {
+  __m256i first = _mm256_set1_epi8(pat[0]);
+  __m256i last = _mm256_set1_epi8(pat[n - 1]);
+  return matches_avx2(s, first, last, n) |
+         (uint64_t)matches_avx2(s + 32, first, last, n) << 32;
+}
+#endif /* !__SSE2__ */
+
+static const counter_t counters[] = {
+  {"scalar", NULL, NULL, NULL},
+#ifdef __SSE2__
+  {"sse2", classify_sse2, lines_sse2, candidates_sse2},
+  {"avx2", classify_avx2, lines_avx2, candidates_avx2},
+#endif
+  {NULL, NULL, NULL, NULL},
+};
+
+static const counter_t *counter = NULL;
+
+static bool supported(const counter_t *co) {
+#ifdef __SSE2__
+  if (!strcmp(co->isa, "avx2"))
+    return __builtin_cpu_supports("avx2");
+#endif
+  return true;
+}
+
+/* Choose counter used by `wc` and `grep` builtins. If `isa` is NULL the best
+ * one supported by the processor is used. Returns false if `isa` is not known
+ * or not supported. */
+bool usecounter(const char *isa) {
+  const counter_t *best = NULL;
+
+  for (const counter_t *co = counters; co->isa; co++) {
+    if (!supported(co))
+      continue;
+    if (isa == NULL || !strcmp(co->isa, isa))
+      best = co;
+  }
+
+  if (best)
+    counter = best;
+  return best != NULL;
+}
+
+typedef struct counts {
+  size_t lines, words, bytes;
+  bool inword; /* last byte counted is a part of a word */
+} counts_t;
+
+/* Whitespace as told by isspace in C locale, like vectorized counters do. */
+static INLINE bool whitespace(char c) {
+  return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+/* Count block of `n` bytes at `s`, padded with whitespace to 64 bytes. */
+static INLINE void countblock(counts_t *c, const char *s, size_t n) {
+  uint64_t newlines, spaces;
+  counter->classify(s, &newlines, &spaces);
+
+  /* Word starts right after whitespace, including that of previous block. */
+  uint64_t starts = ~spaces & (spaces << 1 | !c->inword);
+  c->lines += __builtin_popcountll(newlines);
+  c->words += __builtin_popcountll(starts);
+  c->inword = !(spaces >> (n - 1) & 1);
+}
+
+/* Add lines, words and bytes of `n` bytes at `s` to `c`. Words may continue
+ * from one call to the next. */
+static void counttext(counts_t *c, const char *s, size_t n) {
+  c->bytes += n;
+
+  if (counter->classify == NULL) {
+    for (size_t i = 0; i < n; i++) {
+      bool space = whitespace(s[i]);
+      c->lines += s[i] == '\n';
+      c->words += !space && !c->inword;
+      c->inword = !space;
+    }
+    return;
+  }
+
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64)
+    countblock(c, s + i, 64);
+
+  /* Last block is copied, so that counter never reads past the text. */
+  if (i < n) {
+    char last[64];
+    memset(last, ' ', sizeof(last));
+    memcpy(last, s + i, n - i);
+    countblock(c, last, n - i);
+  }
+}
+
+/* Returns position of first occurrence of `pat` of length `n` > 0 in `len`
+ * bytes at `s`, or `len` if there's none. */
+static size_t find(const char *s, size_t len, const char *pat, size_t n) {
+  size_t i = 0;
+
+  /* Candidates are checked against the whole pattern, as long as the counter
+   * can look at 64 positions without reading past the text. */
+  if (counter->candidates) {
+    for (; i + 64 + n - 1 <= len; i += 64) {
+      uint64_t found = counter->candidates(s + i, pat, n);
+      for (; found; found &= found - 1) {
+        size_t j = i + __builtin_ctzll(found);
+        if (!memcmp(s + j + 1, pat + 1, n - 1))
+          return j;
+      }
+    }
+  }
+
+  while (i + n <= len) {
+    const char *p = memchr(s + i, pat[0], len - n + 1 - i);
+    if (p == NULL)
+      break;
+    i = p - s;
+    if (!memcmp(p + 1, pat + 1, n - 1))
+      return i;
+    i++;
+  }
+
+  return len;
+}
+
+/* Returns number of lines in `len` bytes at `s` that contain `pat` of length
+ * `n`. Last line may lack a newline. */
+static size_t countmatching(const char *s, size_t len, const char *pat,
+                            size_t n) {
+  size_t count = 0;
+
+  for (size_t i = 0; i < len;) {
+    size_t j = n > 0 ? i + find(s + i, len - i, pat, n) : i;
+    if (j == len)
+      break;
+    count++;
+    /* Other occurrences in the same line don't matter. */
+    const char *nl = memchr(s + j, '\n', len - j);
+    if (nl == NULL)
+      break;
+    i = nl - s + 1;
+  }
+
+  return count;
+}
+
+#define LINES 1
+#define WORDS 2
+#define BYTES 4
+
+/* Returns counts asked for by options at the front of `*argvp` and advances it
+ * to file names. Returns 0 if there's an option the builtin does not know. */
+static int wcoptions(char ***argvp) {
+  char **argv = *argvp;
+  int what = 0;
+
+  for (; *argv && (*argv)[0] == '-' && (*argv)[1]; argv++) {
+    for (char *opt = *argv + 1; *opt; opt++) {
+      if (*opt == 'l')
+        what |= LINES;
+      else if (*opt == 'w')
+        what |= WORDS;
+      else if (*opt == 'c')
+        what |= BYTES;
+      else
+        return 0;
+    }
+  }
+
+  *argvp = argv;
+  return what ? what : LINES | WORDS | BYTES;
+}
+
+bool wc_accepts(char **argv) {
+  return wcoptions(&argv) != 0;
+}
+
+/* Columns are as wide as total size of regular files needs them to be, or 7
+ * if there's any other kind of file. A single number is not padded at all. */
+static int wcwidth(char **files, int what) {
+  if (files[1] == NULL && (what & (what - 1)) == 0)
+    return 1;
+
+  off_t total = 0;
+  for (; *files; files++) {
+    struct stat sb;
+    int rc = strcmp(*files, "-") ? stat(*files, &sb)
+                                 : fstat(cofd(STDIN_FILENO), &sb);
+    if (rc < 0)
+      continue;
+    if (!S_ISREG(sb.st_mode))
+      return 7;
+    total += sb.st_size;
+  }
+
+  int width = 1;
+  for (; total >= 10; total /= 10)
+    width++;
+  return width;
+}
+
+/* Add lines and bytes of `n` bytes at `s` to `c`, without looking for words.
+ * That's what `wc -l` does and it's much cheaper. */
+static void countlines(counts_t *c, const char *s, size_t n) {
+  size_t i = counter->lines ? n & ~(size_t)63 : 0;
+
+  c->bytes += n;
+  if (i > 0)
+    c->lines += counter->lines(s, i);
+  for (; i < n; i++)
+    c->lines += s[i] == '\n';
+}
+
+/* Count what's read from `fd` into `c`. Returns false on read error. */
+static bool wcfd(int fd, int what, counts_t *c) {
+  /* Size of regular file is known without reading it. */
+  struct stat sb;
+  if (what == BYTES && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos >= 0) {
+      c->bytes = sb.st_size > pos ? sb.st_size - pos : 0;
+      return true;
+    }
+  }
+
+  char *buf = Malloc(CHUNK);
+  ssize_t n;
+
+  while ((n = coread(fd, buf, CHUNK)) > 0) {
+    if (what & WORDS)
+      counttext(c, buf, n);
+    else
+      countlines(c, buf, n);
+  }
+
+  free(buf);
+  return n == 0;
+}
+
+static void wcprint(const counts_t *c, int what, int width, const char *name) {
+  size_t values[] = {c->lines, c->words, c->bytes};
+  const char *sep = "";
+
+  for (int i = 0; i < 3; i++) {
+    if (what & (1 << i)) {
+      printf("%s%*zu", sep, width, values[i]);
+      sep = " ";
+    }
+  }
+  if (name)
+    printf(" %s", name);
+  printf("\n");
+}
+
+/*
+ * Count newlines, words and bytes.
+ * 'wc [-lwc]' - count standard input
+ * 'wc [-lwc] file ...' - count files and print total if there's more than one
+ */
+int do_wc(char **argv) {
+  static char *stdin_only[] = {"-", NULL};
+  int what = wcoptions(&argv);
+  char **files = argv[0] ? argv : stdin_only;
+  int width = wcwidth(files, what);
+  counts_t total = {};
+  int rc = 0;
+
+  if (counter == NULL)
+    (void)usecounter(NULL);
+
+  for (; *files; files++) {
+    const char *name = argv[0] ? *files : NULL;
+    int input = cofd(STDIN_FILENO);
+
+    if (strcmp(*files, "-") &&
+        (input = open(*files, O_RDONLY | O_CLOEXEC)) < 0) {
+      msg("wc: %s: %s\n", *files, strerror(errno));
+      rc = 1;
+      continue;
+    }
+
+    counts_t c = {};
+    bool ok = wcfd(input, what, &c);
+    int error = errno;
+
+    if (input != cofd(STDIN_FILENO))
+      Close(input);
+
+    if (!ok) {
+      rc = 1;
+      /* User interrupted us, so don't go on. */
+      if (error == EINTR)
+        break;
+      msg("wc: %s: %s\n", *files, strerror(error));
+    }
+
+    wcprint(&c, what, width, name);
+    total.lines += c.lines;
+    total.words += c.words;
+    total.bytes += c.bytes;
+  }
+
+  if (argv[0] && argv[1])
+    wcprint(&total, what, width, "total");
+
+  return rc;
+}
+
+/* Returns pattern of `grep -c` or `grep -cF` at the front of `*argvp` and
+ * advances it to file names. Returns NULL if there's an option the builtin
+ * does not know or a pattern it cannot search for. */
+static char *grepoptions(char ***argvp) {
+  char **argv = *argvp;
+  bool count = false, fixed = false;
+
+  for (; *argv && (*argv)[0] == '-' && (*argv)[1]; argv++) {
+    for (char *opt = *argv + 1; *opt; opt++) {
+      if (*opt == 'c')
+        count = true;
+      else if (*opt == 'F')
+        fixed = true;
+      else
+        return NULL;
+    }
+  }
+
+  char *pat = *argv;
+  if (!count || pat == NULL)
+    return NULL;
+
+  /* Basic regular expression without special characters matches itself.
+   * Newline separates patterns in both cases. */
+  const char *special = fixed ? "\n" : "\n.[*^$\\";
+  if (pat[strcspn(pat, special)] != '\0')
+    return NULL;
+
+  *argvp = argv + 1;
+  return pat;
+}
+
+bool grep_accepts(char **argv) {
+  return grepoptions(&argv) != NULL;
+}
+
+/* Returns number of lines read from `fd` that contain `pat` of length `n`,
+ * or -1 on read error. */
+static ssize_t grepfd(int fd, const char *pat, size_t n) {
+  size_t cap = CHUNK, len = 0, count = 0;
+  char *buf = Malloc(cap);
+  ssize_t nread;
+
+  while ((nread = coread(fd, buf + len, cap - len)) > 0) {
+    len += nread;
+
+    /* Last line may go on in the next chunk, so it's left for later. */
+    size_t done = len;
+    while (done > 0 && buf[done - 1] != '\n')
+      done--;
+
+    count += countmatching(buf, done, pat, n);
+    memmove(buf, buf + done, len - done);
+    len -= done;
+
+    if (len == cap) {
+      cap *= 2;
+      buf = Realloc(buf, cap);
+    }
+  }
+
+  if (nread == 0)
+    count += countmatching(buf, len, pat, n);
+
+  free(buf);
+  return nread < 0 ? -1 : (ssize_t)count;
+}
+
+/*
+ * Count lines that contain a fixed string.
+ * 'grep -c[F] pattern' - count lines of standard input
+ * 'grep -c[F] pattern file ...' - count lines of each file
+ */
+int do_grep(char **argv) {
+  static char *stdin_only[] = {"-", NULL};
+  char *pat = grepoptions(&argv);
+  size_t n = strlen(pat);
+  char **files = argv[0] ? argv : stdin_only;
+  bool many = argv[0] && argv[1];
+  bool found = false, failed = false;
+
+  if (counter == NULL)
+    (void)usecounter(NULL);
+
+  for (; *files; files++) {
+    const char *name = strcmp(*files, "-") ? *files : "(standard input)";
+    int input = cofd(STDIN_FILENO);
+
+    if (strcmp(*files, "-") &&
+        (input = open(*files, O_RDONLY | O_CLOEXEC)) < 0) {
+      msg("grep: %s: %s\n", name, strerror(errno));
+      failed = true;
+      continue;
+    }
+
+    ssize_t count = grepfd(input, pat, n);
+    int error = errno;
+
+    if (input != cofd(STDIN_FILENO))
+      Close(input);
+
+    if (count < 0) {
+      failed = true;
+      /* User interrupted us, so don't go on. */
+      if (error == EINTR)
+        break;
+      msg("grep: %s: %s\n", name, strerror(error));
+      continue;
+    }
+
+    if (many)
+      printf("%s:", name);
+    printf("%zd\n", count);
+    found |= count > 0;
+  }
+
+  /* Just like grep, errors matter more than matches. */
+  return failed ? 2 : found ? 0 : 1;
+}
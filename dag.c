@@ -0,0 +1,388 @@
+#include "shell.h"
+
+/* `dag` runs steps described in a file, each one as soon as steps it depends
+ * on have succeeded, so independent ones overlap. The file looks like rules
+ * of a Makefile, each with exactly one command:
+ *
+ *   # comment
+ *   fetch:
+ *     curl -o data.csv http://example.com/data.csv
+ *   load: fetch schema
+ *     psql -f load.sql
+ *
+ * Steps are background jobs in shell's job table, waited for just like in
+ * parallel.c. If a step fails, steps that depend on it are cancelled, while
+ * the others go on. ^C kills steps that run and no more are started. */
+
+enum { PENDING, STARTED, DONE, FAILED, CANCELLED };
+
+static const char *statename[] = {"pending", "started", "done", "failed",
+                                  "cancelled"};
+
+typedef struct step {
+  char *name;
+  char **argv;   /* command, words are separated by blanks */
+  char **dnames; /* names of steps it depends on, as given in the file */
+  int *deps;     /* indices of steps it depends on */
+  int ndeps;
+  int nwait;     /* number of dependencies that have not succeeded yet */
+  int state;     /* one of the values above */
+  int job;       /* slot in job table while it's running */
+  int status;    /* exit status once it has finished */
+  double start;  /* seconds since the beginning, when it was started */
+  double end;    /* ... and when it was found to have finished */
+} step_t;
+
+typedef struct dag {
+  step_t *step;
+  int nsteps;
+  arena_t arena;
+} dag_t;
+
+#define BLANKS " \t"
+
+/* Splits `line` into words separated by blanks, which are terminated with
+ * NULL. The line is modified. */
+static char **splitwords(arena_t *arena, char *line, int *countp) {
+  int n = 0;
+  char **words = arena_alloc(arena, sizeof(char *) * (strlen(line) / 2 + 2));
+  for (char *w = strtok(line, BLANKS); w; w = strtok(NULL, BLANKS))
+    words[n++] = arena_strdup(arena, w);
+  words[n] = NULL;
+  if (countp)
+    *countp = n;
+  return words;
+}
+
+static int findstep(dag_t *dag, const char *name) {
+  for (int i = 0; i < dag->nsteps; i++)
+    if (!strcmp(dag->step[i].name, name))
+      return i;
+  return -1;
+}
+
+/* Reads steps from file. Returns false and complains about the first error
+ * that is found. */
+static bool readdag(dag_t *dag, const char *path) {
+  FILE *f = fopen(path, "re");
+  if (f == NULL) {
+    msg("dag: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int lineno = 0;
+  step_t *step = NULL;
+  bool ok = true;
+
+  while (ok && (len = getline(&line, &cap, f)) >= 0) {
+    lineno++;
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+
+    char *text = line + strspn(line, BLANKS);
+    if (*text == '\0' || *text == '#')
+      continue;
+
+    if (text != line) {
+      /* Indented line is the command of the step above. */
+      if (step == NULL || step->argv) {
+        msg("dag: %s:%d: command without a step\n", path, lineno);
+        ok = false;
+        break;
+      }
+      step->argv = splitwords(&dag->arena, text, NULL);
+      continue;
+    }
+
+    if (step && step->argv == NULL) {
+      msg("dag: %s:%d: step '%s' has no command\n", path, lineno, step->name);
+      ok = false;
+      break;
+    }
+
+    char *colon = strchr(line, ':');
+    char *blank = strpbrk(line, BLANKS);
+    if (colon == NULL || colon == line || (blank && blank < colon)) {
+      msg("dag: %s:%d: expected 'name: dependencies...'\n", path, lineno);
+      ok = false;
+      break;
+    }
+    *colon = '\0';
+    if (findstep(dag, line) >= 0) {
+      msg("dag: %s:%d: step '%s' defined again\n", path, lineno, line);
+      ok = false;
+      break;
+    }
+
+    if (powerof2(dag->nsteps))
+      dag->step = Realloc(dag->step, sizeof(step_t) *
+                                       (dag->nsteps ? dag->nsteps * 2 : 1));
+    step = &dag->step[dag->nsteps++];
+    *step = (step_t){.name = arena_strdup(&dag->arena, line), .job = -1};
+    step->dnames = splitwords(&dag->arena, colon + 1, &step->ndeps);
+  }
+
+  if (ok && step && step->argv == NULL) {
+    msg("dag: %s: step '%s' has no command\n", path, step->name);
+    ok = false;
+  }
+
+  free(line);
+  fclose(f);
+  return ok;
+}
+
+/* Resolves names of dependencies and makes sure there's no cycle, or else
+ * some steps would never run. */
+static bool checkdag(dag_t *dag) {
+  for (int i = 0; i < dag->nsteps; i++) {
+    step_t *step = &dag->step[i];
+    step->deps = arena_alloc(&dag->arena, sizeof(int) * (step->ndeps + 1));
+    for (int d = 0; d < step->ndeps; d++) {
+      if ((step->deps[d] = findstep(dag, step->dnames[d])) < 0) {
+        msg("dag: step '%s' depends on unknown '%s'\n", step->name,
+            step->dnames[d]);
+        return false;
+      }
+    }
+    step->nwait = step->ndeps;
+  }
+
+  /* Kahn's algorithm: steps that are left once all that can be ordered have
+   * been removed lie on a cycle or depend on one. */
+  int *nwait = Malloc(sizeof(int) * dag->nsteps);
+  int *order = Malloc(sizeof(int) * dag->nsteps);
+  int n = 0;
+
+  for (int i = 0; i < dag->nsteps; i++)
+    if ((nwait[i] = dag->step[i].ndeps) == 0)
+      order[n++] = i;
+
+  for (int k = 0; k < n; k++)
+    for (int i = 0; i < dag->nsteps; i++)
+      for (int d = 0; d < dag->step[i].ndeps; d++)
+        if (dag->step[i].deps[d] == order[k] && --nwait[i] == 0)
+          order[n++] = i;
+
+  if (n < dag->nsteps) {
+    for (int i = 0; i < dag->nsteps; i++) {
+      if (nwait[i] > 0) {
+        msg("dag: step '%s' is on a dependency cycle\n", dag->step[i].name);
+        break;
+      }
+    }
+  }
+
+  free(nwait);
+  free(order);
+  return n == dag->nsteps;
+}
+
+/* Cancels steps that depend on step `s`, directly or not. */
+static int cancel(dag_t *dag, int s) {
+  int n = 0;
+  for (int i = 0; i < dag->nsteps; i++) {
+    step_t *step = &dag->step[i];
+    if (step->state != PENDING)
+      continue;
+    for (int d = 0; d < step->ndeps; d++) {
+      if (step->deps[d] == s) {
+        step->state = CANCELLED;
+        msg("dag: %s cancelled, as %s has not succeeded\n", step->name,
+            dag->step[s].name);
+        n += 1 + cancel(dag, i);
+        break;
+      }
+    }
+  }
+  return n;
+}
+
+/* Step `s` has succeeded, so steps that depend on it wait for one less. */
+static void release(dag_t *dag, int s) {
+  for (int i = 0; i < dag->nsteps; i++)
+    for (int d = 0; d < dag->step[i].ndeps; d++)
+      if (dag->step[i].deps[d] == s)
+        dag->step[i].nwait--;
+}
+
+/* Critical path is a chain of steps, each of which was started once the
+ * previous one had finished, that ends with the step that finished last.
+ * Shortening any other step would not make the whole run any shorter. */
+static void printpath(dag_t *dag) {
+  int last = -1;
+  for (int i = 0; i < dag->nsteps; i++)
+    if (dag->step[i].state == DONE || dag->step[i].state == FAILED)
+      if (last < 0 || dag->step[i].end > dag->step[last].end)
+        last = i;
+  if (last < 0)
+    return;
+
+  /* Chain is found from its end, the step that was waited for the longest is
+   * the one that finished last among dependencies. */
+  int *path = Malloc(sizeof(int) * dag->nsteps);
+  int n = 0;
+  for (int s = last; s >= 0;) {
+    path[n++] = s;
+    step_t *step = &dag->step[s];
+    s = -1;
+    for (int d = 0; d < step->ndeps; d++)
+      if (s < 0 || dag->step[step->deps[d]].end > dag->step[s].end)
+        s = step->deps[d];
+  }
+
+  msg("dag: critical path:\n");
+  while (n-- > 0) {
+    step_t *step = &dag->step[path[n]];
+    msg("  %-16s %8.3fs + %8.3fs  %s\n", step->name, step->start,
+        step->end - step->start, statename[step->state]);
+  }
+  free(path);
+}
+
+static void report(dag_t *dag, double total) {
+  int count[CANCELLED + 1] = {};
+  for (int i = 0; i < dag->nsteps; i++)
+    count[dag->step[i].state]++;
+
+  msg("dag: %d steps in %.3fs, %d done, %d failed, %d cancelled", dag->nsteps,
+      total, count[DONE], count[FAILED], count[CANCELLED]);
+  if (count[PENDING])
+    msg(", %d not run", count[PENDING]);
+  msg("\n");
+  printpath(dag);
+}
+
+/* Runs steps of `dag` with as many of them at once as dependencies allow.
+ * Returns true if it was interrupted. */
+static bool rundag(dag_t *dag, sigset_t *set) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int nrunning = 0;
+  bool stop = false;
+
+  do {
+    /* Start every step that is ready. */
+    for (int i = 0; i < dag->nsteps && !stop; i++) {
+      step_t *step = &dag->step[i];
+      if (step->state != PENDING || step->nwait > 0)
+        continue;
+
+      step->start = since(&start);
+      if ((step->job = startjob(step->argv)) < 0) {
+        step->end = step->start;
+        step->status = W_EXITCODE(127, 0);
+        step->state = FAILED;
+        (void)cancel(dag, i);
+        continue;
+      }
+      step->state = STARTED;
+      nrunning++;
+    }
+
+    if (nrunning == 0)
+      break;
+
+    int sig = sigwaitinfo(set, NULL);
+    if (sig == SIGCHLD) {
+      childevents();
+    } else if (sig == SIGINT && !stop) {
+      stop = true;
+      for (int i = 0; i < dag->nsteps; i++)
+        if (dag->step[i].state == STARTED)
+          (void)killjob(dag->step[i].job);
+    }
+
+    /* Collect finished steps. */
+    for (int i = 0; i < dag->nsteps; i++) {
+      step_t *step = &dag->step[i];
+      if (step->state != STARTED ||
+          jobstate(step->job, &step->status) != FINISHED)
+        continue;
+      step->end = since(&start);
+      step->job = -1;
+      nrunning--;
+      if (step->status == 0) {
+        step->state = DONE;
+        release(dag, i);
+      } else {
+        step->state = FAILED;
+        if (WIFSIGNALED(step->status))
+          msg("dag: %s killed by signal %d\n", step->name,
+              WTERMSIG(step->status));
+        else
+          msg("dag: %s failed, status=%d\n", step->name,
+              WEXITSTATUS(step->status));
+        (void)cancel(dag, i);
+      }
+    }
+  } while (nrunning > 0 || !stop);
+
+  report(dag, since(&start));
+  return stop;
+}
+
+/*
+ * Run steps of a dependency graph described in a file, see above.
+ * 'dag file' - run all steps, each once steps it depends on have succeeded
+ * 'dag -n file' - only check the file and print steps in order they'd start
+ */
+int do_dag(char **argv) {
+  bool dryrun = argv[0] && !strcmp(argv[0], "-n");
+  if (dryrun)
+    argv++;
+
+  if (argv[0] == NULL || argv[1] != NULL) {
+    msg("dag: usage: dag [-n] file\n");
+    return 2;
+  }
+
+  dag_t dag = {};
+  int rc = 2;
+
+  if (!readdag(&dag, argv[0]) || !checkdag(&dag))
+    goto done;
+
+  if (dryrun) {
+    /* Start order without any step finishing at the same time as another. */
+    for (int left = dag.nsteps; left > 0;) {
+      int i = 0;
+      while (dag.step[i].state != PENDING || dag.step[i].nwait > 0)
+        i++;
+      printf("%s:", dag.step[i].name);
+      for (char **arg = dag.step[i].argv; *arg; arg++)
+        printf(" %s", *arg);
+      printf("\n");
+      dag.step[i].state = DONE;
+      release(&dag, i);
+      left--;
+    }
+    rc = 0;
+    goto done;
+  }
+
+  sigset_t set, mask;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGINT);
+  Sigprocmask(SIG_BLOCK, &set, &mask);
+
+  if (rundag(&dag, &set)) {
+    rc = 128 + SIGINT;
+  } else {
+    rc = 0;
+    for (int i = 0; i < dag.nsteps; i++)
+      if (dag.step[i].state != DONE)
+        rc = 1;
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+done:
+  free(dag.step);
+  arena_free(&dag.arena);
+  return rc;
+}
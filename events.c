@@ -0,0 +1,111 @@
+#include "shell.h"
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+/* Interactive shell waits for user input, children changing their state, ^C
+ * and a timeout all at once. Signals are received through a signalfd, so
+ * they're handled in the same place as input rather than in a handler that
+ * interrupts a read. The timeout is a timerfd, so epoll_wait itself never
+ * times out.
+ *
+ * Descriptors exist only while the shell waits for a command line, since
+ * commands it runs must not find any other than the terminal. */
+
+static int epfd = -1;  /* epoll instance or -1 if not waiting */
+static int sigfd = -1; /* SIGCHLD & SIGINT */
+static int timfd = -1; /* expires when user has been idle for too long */
+static sigset_t evmask, oldmask;
+
+static void evadd(int fd, uint32_t event) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = event};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+}
+
+/* Start waiting for events with `evwait`. If `timeout` is non-zero, EV_TIMEOUT
+ * happens when as many seconds pass without input. */
+void evbegin(int input, unsigned timeout) {
+  sigemptyset(&evmask);
+  sigaddset(&evmask, SIGCHLD);
+  sigaddset(&evmask, SIGINT);
+
+  /* Blocked signals are left pending for signalfd instead of a handler. */
+  Sigprocmask(SIG_BLOCK, &evmask, &oldmask);
+
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    unix_error("epoll_create1 error");
+  if ((sigfd = signalfd(-1, &evmask, SFD_CLOEXEC | SFD_NONBLOCK)) < 0)
+    unix_error("signalfd error");
+
+  evadd(input, EV_INPUT);
+  evadd(sigfd, EV_CHILD | EV_INTR);
+
+  if (timeout > 0) {
+    if ((timfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+      unix_error("timerfd_create error");
+    struct itimerspec its = {.it_value.tv_sec = timeout};
+    if (timerfd_settime(timfd, 0, &its, NULL) < 0)
+      unix_error("timerfd_settime error");
+    evadd(timfd, EV_TIMEOUT);
+  }
+}
+
+/* Returns signal events pending on signalfd. SIGCHLD-s are merged, since it's
+ * all the same which child has changed its state. */
+static int sigevents(void) {
+  struct signalfd_siginfo si;
+  int events = 0;
+
+  while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+    if (si.ssi_signo == SIGCHLD)
+      events |= EV_CHILD;
+    else if (si.ssi_signo == SIGINT)
+      events |= EV_INTR;
+  }
+
+  return events;
+}
+
+/* Wait until any of events happens and return them. Input is not read, so
+ * EV_INPUT is returned for as long as there's some. */
+int evwait(void) {
+  struct epoll_event ev[3];
+  int n, events = 0;
+
+  while ((n = epoll_wait(epfd, ev, 3, -1)) < 0)
+    if (errno != EINTR)
+      unix_error("epoll_wait error");
+
+  for (int i = 0; i < n; i++) {
+    if (ev[i].data.u32 == EV_INPUT)
+      events |= EV_INPUT;
+    else if (ev[i].data.u32 == EV_TIMEOUT)
+      events |= EV_TIMEOUT;
+    else
+      events |= sigevents();
+  }
+
+  return events;
+}
+
+/* Wait until any of `fds` is ready. Coroutines wait for their pipes with it,
+ * so that all event waits are in one place. */
+void evready(struct pollfd *fds, int nfds) {
+  while (poll(fds, nfds, -1) < 0)
+    if (errno != EINTR)
+      unix_error("Poll error");
+}
+
+/* Stop waiting for events. Signals that came after last `evwait` are left
+ * pending, so their handlers run once they're unblocked. */
+void evend(void) {
+  (void)close(epfd);
+  (void)close(sigfd);
+  epfd = sigfd = -1;
+  if (timfd >= 0) {
+    (void)close(timfd);
+    timfd = -1;
+  }
+  Sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
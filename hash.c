@@ -0,0 +1,297 @@
+#include "shell.h"
+#include <asm/unistd.h>
+
+/* Linux specific, glibc hides them unless _GNU_SOURCE is defined. */
+#ifndef O_PATH
+#define O_PATH __O_PATH
+#endif
+
+/* If set directories from PATH are held open, so that looking up and starting
+ * a command does not walk directory path each time. */
+bool opt_pathfd = false;
+
+/* Directory listed in PATH environment variable. */
+typedef struct pathdir {
+  char *name;            /* directory path as found in PATH */
+  int fd;                /* O_PATH descriptor of directory or -1 */
+  dev_t dev;             /* device & inode tell if it's the same directory */
+  ino_t ino;             /* ... e.g. after `cd` for relative paths */
+  struct timespec mtime; /* modification time when last checked */
+} pathdir_t;
+
+/* Remembered result of command lookup in PATH directories. */
+struct cmdent {
+  struct cmdent *next; /* next entry in the same bucket */
+  char *name;          /* command name */
+  char *path;          /* location of executable or NULL if not found */
+  int dir;             /* index of directory where command was found */
+  int error;           /* errno value if command was not found */
+  unsigned hits;       /* number of times the entry was looked up */
+};
+
+static char *path = NULL;         /* PATH value directories come from */
+static pathdir_t *pathdir = NULL; /* array of directories from PATH */
+static int npathdir = 0;          /* number of directories in PATH */
+static cmdent_t **cmdtab = NULL;  /* hash table of remembered commands */
+static unsigned ncmdtab = 0;      /* number of buckets (power of 2) */
+static unsigned ncmds = 0;        /* number of remembered commands */
+static cmdent_t direct;           /* command given by its location */
+
+/* Hash function reads aligned keys a word at a time, also past their end,
+ * which address sanitizer does not like. Hence it's given a copy of `name`
+ * padded with zeros to a whole number of words. */
+static cmdent_t **bucket(const char *name) {
+  size_t len = strlen(name);
+  size_t nwords = len / sizeof(uint32_t) + 1;
+  uint32_t buf[16];
+  uint32_t *key = nwords <= 16 ? buf : Malloc(nwords * sizeof(uint32_t));
+
+  key[nwords - 1] = 0;
+  memcpy(key, name, len);
+  uint32_t hash = jenkins_hash(key, len, HASHINIT);
+
+  if (key != buf)
+    free(key);
+  return &cmdtab[hash & (ncmdtab - 1)];
+}
+
+/* Forget commands that depend on contents of `dir`. Commands found in
+ * earlier directories are not affected, all other may have changed. */
+static void forget(int dir) {
+  for (unsigned i = 0; i < ncmdtab; i++) {
+    cmdent_t **entp = &cmdtab[i];
+    while (*entp) {
+      cmdent_t *ent = *entp;
+      if (ent->path && ent->dir < dir) {
+        entp = &ent->next;
+        continue;
+      }
+      *entp = ent->next;
+      free(ent->name);
+      free(ent->path);
+      free(ent);
+      ncmds--;
+    }
+  }
+}
+
+/* Returns descriptor of `dir` if it's held open or -1. Descriptors are opened
+ * on first use and closed if `pathfd` option was turned off. Relative paths
+ * are never held, since they change meaning with current directory. */
+static int holddir(pathdir_t *dir) {
+  if (!opt_pathfd) {
+    if (dir->fd >= 0) {
+      (void)close(dir->fd);
+      dir->fd = -1;
+    }
+  } else if (dir->fd < 0 && dir->name[0] == '/') {
+    dir->fd = open(dir->name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  }
+  return dir->fd;
+}
+
+/* Returns true if `dir` is not the same as when it was checked last time.
+ * Directory held open is the same one as long as descriptor is valid, even if
+ * it was renamed or replaced with another one. */
+static bool changed(pathdir_t *dir) {
+  struct stat sb;
+  int fd = holddir(dir);
+
+  if ((fd >= 0 ? fstat(fd, &sb) : stat(dir->name, &sb)) < 0)
+    memset(&sb, 0, sizeof(sb));
+
+  if (sb.st_dev == dir->dev && sb.st_ino == dir->ino &&
+      sb.st_mtim.tv_sec == dir->mtime.tv_sec &&
+      sb.st_mtim.tv_nsec == dir->mtime.tv_nsec)
+    return false;
+
+  dir->dev = sb.st_dev;
+  dir->ino = sb.st_ino;
+  dir->mtime = sb.st_mtim;
+  return true;
+}
+
+/* Split PATH into directories. Empty entry means current directory. */
+static void setpath(const char *newpath) {
+  flushcmds();
+
+  for (int i = 0; i < npathdir; i++)
+    free(pathdir[i].name);
+  free(pathdir);
+  free(path);
+
+  path = strdup(newpath);
+  pathdir = NULL;
+  npathdir = 0;
+
+  for (const char *p = newpath;; p++) {
+    size_t n = strcspn(p, ":");
+    pathdir = Realloc(pathdir, sizeof(pathdir_t) * (npathdir + 1));
+    pathdir_t *dir = &pathdir[npathdir++];
+    dir->name = n > 0 ? strndup(p, n) : strdup(".");
+    dir->fd = -1;
+    (void)changed(dir);
+    p += n;
+    if (*p == '\0')
+      break;
+  }
+}
+
+/* Check if directories the entry depends on have changed since we looked
+ * at them. If so forget all entries that are out of date. */
+static bool uptodate(cmdent_t *ent) {
+  int last = ent->path ? ent->dir : npathdir - 1;
+
+  for (int i = 0; i <= last; i++) {
+    if (changed(&pathdir[i])) {
+      forget(i);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Search PATH directories for executable file just like execvp does. */
+static cmdent_t *search(const char *name) {
+  cmdent_t *ent = Malloc(sizeof(cmdent_t));
+  ent->name = strdup(name);
+  ent->path = NULL;
+  ent->error = ENOENT;
+  ent->hits = 0;
+
+  for (int i = 0; i < npathdir; i++) {
+    char *file = NULL;
+    strapp(&file, pathdir[i].name);
+    strapp(&file, "/");
+    strapp(&file, name);
+
+    /* Look up just the last component if directory is held open. */
+    int fd = holddir(&pathdir[i]);
+    const char *at = fd >= 0 ? name : file;
+    if (fd < 0)
+      fd = AT_FDCWD;
+
+    struct stat sb;
+    if (fstatat(fd, at, &sb, 0) == 0 && S_ISREG(sb.st_mode)) {
+      if (faccessat(fd, at, X_OK, 0) == 0) {
+        ent->path = file;
+        ent->dir = i;
+        break;
+      }
+      ent->error = EACCES;
+    }
+    free(file);
+  }
+
+  return ent;
+}
+
+static void insert(cmdent_t *ent) {
+  if (ncmds >= ncmdtab) {
+    cmdent_t **oldtab = cmdtab;
+    unsigned oldn = ncmdtab;
+
+    ncmdtab = oldn ? oldn * 2 : 64;
+    cmdtab = Calloc(ncmdtab, sizeof(cmdent_t *));
+
+    for (unsigned i = 0; i < oldn; i++) {
+      cmdent_t *next;
+      for (cmdent_t *e = oldtab[i]; e; e = next) {
+        cmdent_t **entp = bucket(e->name);
+        next = e->next;
+        e->next = *entp;
+        *entp = e;
+      }
+    }
+
+    free(oldtab);
+  }
+
+  cmdent_t **entp = bucket(ent->name);
+  ent->next = *entp;
+  *entp = ent;
+  ncmds++;
+}
+
+/* Returns command `name` to be passed to `execcmd`. Consults and updates the
+ * table of remembered commands, so PATH is not searched each time. If command
+ * was not found returns NULL and sets errno. Returned entry is valid until
+ * next call. */
+cmdent_t *findcmd(const char *name) {
+  const char *newpath = getenv("PATH");
+
+  if (index(name, '/') || !newpath) {
+    direct.name = direct.path = (char *)name;
+    direct.dir = -1;
+    return &direct;
+  }
+
+  if (!path || strcmp(path, newpath))
+    setpath(newpath);
+
+  cmdent_t *ent = NULL;
+
+  if (ncmdtab > 0) {
+    for (ent = *bucket(name); ent; ent = ent->next)
+      if (!strcmp(ent->name, name))
+        break;
+    if (ent && !uptodate(ent))
+      ent = NULL;
+  }
+
+  if (!ent) {
+    ent = search(name);
+    insert(ent);
+  }
+
+  ent->hits++;
+  if (!ent->path) {
+    errno = ent->error;
+    return NULL;
+  }
+  return ent;
+}
+
+/* Replaces process image with command found by `findcmd`. Called between
+ * vfork and execve, so it must not touch anything but the entry. Returns only
+ * on failure. An interpreter of `#!` script is given the script as
+ * /dev/fd/N/name, which does not exist once close-on-exec descriptor `N` is
+ * gone, so then execveat fails with ENOENT and the path is used instead. */
+void execcmd(cmdent_t *cmd, char **argv) {
+  if (cmd->dir >= 0 && cmd->dir < npathdir && pathdir[cmd->dir].fd >= 0) {
+    (void)syscall(__NR_execveat, pathdir[cmd->dir].fd, cmd->name, argv,
+                  environ, 0);
+    if (errno != ENOENT)
+      return;
+  }
+  (void)execve(cmd->path, argv, environ);
+}
+
+/* Display remembered commands. */
+void printcmds(void) {
+  if (ncmds == 0)
+    return;
+
+  printf("hits\tcommand\n");
+  for (unsigned i = 0; i < ncmdtab; i++) {
+    for (cmdent_t *ent = cmdtab[i]; ent; ent = ent->next) {
+      if (ent->path)
+        printf("%4u\t%s\n", ent->hits, ent->path);
+      else
+        printf("%4u\t%s: %s\n", ent->hits, ent->name, strerror(ent->error));
+    }
+  }
+}
+
+/* Forget all remembered commands and let go of directories held open. */
+void flushcmds(void) {
+  forget(0);
+
+  for (int i = 0; i < npathdir; i++) {
+    if (pathdir[i].fd >= 0) {
+      (void)close(pathdir[i].fd);
+      pathdir[i].fd = -1;
+    }
+  }
+}
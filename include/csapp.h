@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdnoreturn.h>
 #include <string.h>
 #include <termios.h>
@@ -94,6 +95,22 @@ void *Malloc(size_t size);
 void *Realloc(void *ptr, size_t size);
 void *Calloc(size_t nmemb, size_t size);
 
+/* Arena allocator: memory is released all at once, not by single objects.
+ * Zero-initialized arena_t is empty and ready to use. */
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct arena {
+  arena_chunk_t *chunk; /* current chunk, previous ones are linked to it */
+  size_t used;          /* number of bytes used in current chunk */
+  void *last;           /* most recent allocation, can be resized in place */
+} arena_t;
+
+void *arena_alloc(arena_t *a, size_t size);
+void *arena_realloc(arena_t *a, void *ptr, size_t oldsize, size_t size);
+char *arena_strdup(arena_t *a, const char *s);
+void arena_reset(arena_t *a);
+void arena_free(arena_t *a);
+
 /* Process control wrappers */
 pid_t Fork(void);
 pid_t Waitpid(pid_t pid, int *iptr, int options);
@@ -129,6 +146,7 @@ void Ftruncate(int fd, off_t length);
 int Dup(int fd);
 int Dup2(int oldfd, int newfd);
 void Pipe(int fds[2]);
+void Pipe2(int fds[2], int flags);
 void Socketpair(int domain, int type, int protocol, int sv[2]);
 int Select(int n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
            struct timeval *timeout);
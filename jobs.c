@@ -1,24 +1,200 @@
 #include "shell.h"
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include "tree.h"
+#include "queue.h"
+#include "bitstring.h"
+
+/* Entry of index that maps pid to process. Allocated separately from process,
+ * since arrays of processes get reallocated. */
+typedef struct pident {
+  RB_ENTRY(pident) link;
+  pid_t pid; /* process identifier */
+  int job;   /* slot in jobs array */
+  int proc;  /* index in array of job's processes */
+} pident_t;
 
 typedef struct proc {
-  pid_t pid;    /* process identifier */
-  int state;    /* RUNNING or STOPPED or FINISHED */
-  int exitcode; /* -1 if exit status not yet received */
+  pid_t pid;      /* process identifier */
+  int state;      /* RUNNING or STOPPED or FINISHED */
+  int exitcode;   /* -1 if exit status not yet received */
+  pident_t *ent;  /* entry in pid index or NULL if process was not started */
+  char *command;  /* textual representation of process' argv */
+  bool piped;     /* standard output goes to the next stage */
+  bool cut;       /* process was signalled by `cutoff` */
 } proc_t;
 
 typedef struct job {
   pid_t pgid;            /* 0 if slot is free */
-  proc_t *proc;          /* array of processes running in as a job */
+  proc_t *proc;          /* processes in order of pipeline stages */
   struct termios tmodes; /* saved terminal modes */
   int nproc;             /* number of processes */
+  int nstate[3];         /* number of processes in each state */
   int state;             /* changes when live processes have same state */
-  char *command;         /* textual representation of command line */
+  char *command;         /* command line, joined from processes on demand */
+  bool killed;           /* user has already requested to kill the job */
+  int cutoff;            /* signal for processes upstream of finished one */
+  struct qent *queued;   /* entry in run queue if job is QUEUED */
+  arena_t arena;         /* memory for command, processes and their entries */
 } job_t;
 
+/* Entry of run queue, allocated from arena of the job, since jobs array gets
+ * reallocated. Pipeline is a copy, as parse cache may drop the original. */
+typedef struct qent {
+  TAILQ_ENTRY(qent) link;
+  int job;          /* slot in jobs array */
+  pipeline_t *pipe; /* what to run once the job is admitted */
+} qent_t;
+
 static job_t *jobs = NULL;          /* array of all jobs */
-static int njobmax = 1;             /* number of slots in jobs array */
+static int njobmax = 1;             /* number of slots ever used */
+static int njobcap = 8;             /* number of slots in jobs array */
+static bitstr_t *jobmap = NULL;     /* slots in use, foreground is always */
+static int jobhint = BG;            /* there's no free slot below this one */
 static int tty_fd = -1;             /* controlling terminal file descriptor */
 static struct termios shell_tmodes; /* saved shell terminal modes */
+static int nunreported = 0; /* background jobs finished on their own */
+static unsigned ncutoff = 0; /* processes signalled since reader finished */
+static double cutoffused = 0; /* CPU time they had used when reaped */
+
+/* Background jobs over the limit wait in order they were started. */
+static TAILQ_HEAD(, qent) runqueue = TAILQ_HEAD_INITIALIZER(runqueue);
+static int nqueued = 0;  /* number of jobs in run queue */
+static int admitted = 0; /* slot handed over by `admitjob` to next `addjob` */
+
+/* State change of a child as returned by waitpid. */
+typedef struct chld {
+  pid_t pid;
+  int status;
+  double cpu; /* user and system time used by child if it was reaped */
+} chld_t;
+
+/* Signal handler only collects state changes of children into a ring and the
+ * shell applies them to jobs later on, see `drain`. Since the handler never
+ * touches jobs, they can be modified without blocking SIGCHLD. The handler is
+ * the only producer and the shell is the only consumer, so the ring needs no
+ * locks, just ordering of stores to entries and indices. */
+#define RINGSIZE 256 /* power of two */
+
+static chld_t ring[RINGSIZE];
+static atomic_uint ringhead; /* next entry to be written by the handler */
+static atomic_uint ringtail; /* next entry to be read by the shell */
+static atomic_bool ringfull; /* handler has left changes with the kernel */
+static atomic_uint nuncut;   /* signalled by `cutoff` but not reaped yet */
+
+/* If set, processes of new jobs whose output nobody reads any longer get this
+ * signal right away, rather than SIGPIPE when they write next time. */
+int opt_cutoff = 0;
+
+/* If non-zero, at most that many background jobs run at once. If pressure is
+ * set as well, jobs are also held back while CPU is overcommitted. */
+int opt_bglimit = 0;
+bool opt_bgpressure = false;
+
+/* Share of time in percent, over last 10 seconds, that some runnable task had
+ * to wait for CPU, above which `bglimit pressure` holds jobs back. */
+#define PRESSURE_MAX 20.0
+
+static int pidcmp(pident_t *a, pident_t *b) {
+  return a->pid < b->pid ? -1 : a->pid > b->pid;
+}
+
+static RB_HEAD(pidtree, pident) pidtree = RB_INITIALIZER(&pidtree);
+RB_GENERATE_STATIC(pidtree, pident, link, pidcmp);
+
+/* Returns process `pid` belongs to or NULL if it's not a known live one. */
+static proc_t *findproc(pid_t pid, int *jp) {
+  pident_t key = {.pid = pid};
+  pident_t *ent = RB_FIND(pidtree, &pidtree, &key);
+  if (ent == NULL)
+    return NULL;
+  proc_t *proc = &jobs[ent->job].proc[ent->proc];
+  if (proc->state == FINISHED)
+    return NULL;
+  *jp = ent->job;
+  return proc;
+}
+
+/* Process of job `j` changes its state. Job state is derived from number of
+ * processes in each state, so it's updated without looking at the others. */
+static void procstate(int j, proc_t *proc, int state) {
+  job_t *job = &jobs[j];
+  int prev = job->state;
+
+  job->nstate[proc->state]--;
+  job->nstate[state]++;
+  proc->state = state;
+
+  if (job->nstate[FINISHED] == job->nproc)
+    job->state = FINISHED;
+  else if (job->nstate[RUNNING] == 0)
+    job->state = STOPPED;
+  else if (job->nstate[STOPPED] == 0)
+    job->state = RUNNING;
+
+  if (j != FG && !job->killed && prev != FINISHED && job->state == FINISHED)
+    nunreported++;
+}
+
+#ifdef STUDENT
+/* Process `proc` of job `j` has finished, so stages before it write to a pipe
+ * that nobody will read. They'd get SIGPIPE once they write, but they may
+ * compute or wait for input for a long time before that, so they're told now.
+ * Some ignore SIGPIPE, hence job's policy tells which signal to send. */
+static void cutoff(int j, proc_t *proc) {
+  job_t *job = &jobs[j];
+  for (proc_t *up = job->proc; up < proc; up++) {
+    // output redirected to a file is still wanted
+    if (up->state == FINISHED || up->cut || !up->piped)
+      continue;
+    (void)kill(up->pid, job->cutoff);
+    // stopped process would not act upon it
+    if (up->state == STOPPED)
+      (void)kill(up->pid, SIGCONT);
+    up->cut = true;
+    atomic_fetch_add_explicit(&nuncut, 1, memory_order_relaxed);
+    ncutoff++;
+  }
+}
+
+/* Record state change `chld` of process `proc` of job `j`. */
+static void update(int j, proc_t *proc, chld_t *chld) {
+  int status = chld->status;
+  if (WIFEXITED(status) || WIFSIGNALED(status)) {
+    // if terminated save status as is to be later inspected
+    proc->exitcode = status;
+    if (proc->cut) {
+      atomic_fetch_sub_explicit(&nuncut, 1, memory_order_relaxed);
+      cutoffused += chld->cpu;
+    }
+    procstate(j, proc, FINISHED);
+    if (jobs[j].cutoff)
+      cutoff(j, proc);
+  } else if (WIFSTOPPED(status)) {
+    procstate(j, proc, STOPPED);
+  } else if (WIFCONTINUED(status)) {
+    procstate(j, proc, RUNNING);
+  }
+}
+
+#endif /* !STUDENT */
+
+#ifdef STUDENT
+/* Time used by reaped children grows by what the last reaped one used, so it
+ * tells, like wait4 would, how much was that. Returns the growth since `*last`
+ * was taken and updates it, or just current total if `last` is NULL. */
+static double reapedcpu(double *last) {
+  struct rusage ru;
+  (void)getrusage(RUSAGE_CHILDREN, &ru);
+  double now = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+               (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+  if (last == NULL)
+    return now;
+  double used = now - *last;
+  *last = now;
+  return used;
+}
+#endif /* !STUDENT */
 
 static void sigchld_handler(int sig) {
   int old_errno = errno;
@@ -27,82 +203,116 @@ static void sigchld_handler(int sig) {
   /* TODO: Change state (FINISHED, RUNNING, STOPPED) of processes and jobs.
    * Bury all children that finished saving their status in jobs. */
 #ifdef STUDENT
-  proc_t *proc;
-  job_t *job;
-  (void)pid;
-
-  // loop over all jobs checking status for every process in an unfinished job
-  for (int j = 0; j < njobmax; j++) {
-    job = &jobs[j];
-    if (job->pgid != 0) {
-      // loop over all processes in a job
-      for (int k = 0; k < job->nproc; k++) {
-        proc = &(job->proc[k]);
-        if (proc->state != FINISHED) {
-          if ((pid = waitpid(proc->pid, &status, WNOHANG | WUNTRACED))) {
-
-            if (pid > 0) {
-              // if terminated save status as is to be later inspected
-              if (WIFEXITED(status)) {
-                //  exited normally
-                proc->state = FINISHED;
-                proc->exitcode = status;
-              } else if (WIFSIGNALED(status)) {
-                // procpid was terminated by signal
-                proc->state = FINISHED;
-                proc->exitcode = status;
-              } else if (WIFSTOPPED(status)) {
-                proc->state = STOPPED;
-              }
-            }
-          }
-        }
-      }
-
-      // job state changes if all processes changed state to the same state.
-      int st = job->proc[0].state;
-      if (st != job->state) {
-        // job state change is possible
-        for (int m = 1; m < job->nproc; m++) {
-          if (job->proc[m].state != st) {
-            // state remains unchanged
-            st = job->state;
-            break;
-          }
-        }
-      }
-      job->state = st;
+  unsigned head = atomic_load_explicit(&ringhead, memory_order_relaxed);
+  // CPU time is only of interest for processes signalled by `cutoff`
+  bool cut = atomic_load_explicit(&nuncut, memory_order_relaxed) > 0;
+  double cpu = cut ? reapedcpu(NULL) : 0;
+
+  for (;;) {
+    // when the ring is full changes are left with the kernel for later
+    if (head - atomic_load_explicit(&ringtail, memory_order_acquire) ==
+        RINGSIZE) {
+      atomic_store_explicit(&ringfull, true, memory_order_relaxed);
+      break;
     }
+    if ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) <= 0)
+      break;
+    ring[head % RINGSIZE] = (chld_t){.pid = pid, .status = status};
+    if (cut)
+      ring[head % RINGSIZE].cpu = reapedcpu(&cpu);
+    atomic_store_explicit(&ringhead, ++head, memory_order_release);
   }
 #endif /* !STUDENT */
   errno = old_errno;
 }
 
+/* Apply state changes collected by `sigchld_handler` to jobs. Changes of
+ * children that are not known (yet) are dropped, hence SIGCHLD has to be
+ * blocked from starting a process until it's added to its job. */
+static void drain(void) {
+  /* TODO: Update processes and jobs with state changes from the ring. */
+#ifdef STUDENT
+  unsigned tail = atomic_load_explicit(&ringtail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&ringhead, memory_order_acquire);
+
+  for (; tail != head; tail++) {
+    chld_t *chld = &ring[tail % RINGSIZE];
+    proc_t *proc;
+    int j;
+    if ((proc = findproc(chld->pid, &j)))
+      update(j, proc, chld);
+  }
+  atomic_store_explicit(&ringtail, tail, memory_order_release);
+
+  // there's room now, so let the handler collect changes it has left behind
+  if (atomic_exchange_explicit(&ringfull, false, memory_order_relaxed))
+    raise(SIGCHLD);
+#endif /* !STUDENT */
+}
+
+/* Update jobs after SIGCHLD has been received through signalfd rather than
+ * delivered. Must be called with SIGCHLD blocked. */
+void childevents(void) {
+  sigchld_handler(SIGCHLD);
+  drain();
+}
+
 /* When pipeline is done, its exitcode is fetched from the last process. */
 static int exitcode(job_t *job) {
+  /* Job that waits in run queue has no processes yet. */
+  if (job->nproc == 0)
+    return -1;
   return job->proc[job->nproc - 1].exitcode;
 }
 
+/* Must be called with SIGCHLD blocked, as jobs array may be moved. */
 static int allocjob(void) {
-  /* Find empty slot for background job. */
-  for (int j = BG; j < njobmax; j++)
-    if (jobs[j].pgid == 0)
-      return j;
+  /* Find lowest numbered empty slot for background job. Search starts at
+   * a byte boundary, since that's the granularity of bitstring. */
+  int start = jobhint & ~7, j;
+  bit_ffc(&jobmap[start >> 3], njobcap - start, &j);
+
+  if (j >= 0) {
+    j += start;
+  } else {
+    /* If none found, double the number of slots. */
+    int n = njobcap * 2;
+    jobs = Realloc(jobs, sizeof(job_t) * n);
+    memset(&jobs[njobcap], 0, sizeof(job_t) * (n - njobcap));
+    jobmap = Realloc(jobmap, bitstr_size(n));
+    memset(&jobmap[bitstr_size(njobcap)], 0,
+           bitstr_size(n) - bitstr_size(njobcap));
+    j = njobcap;
+    njobcap = n;
+  }
+
+  bit_set(jobmap, j);
+  jobhint = j + 1;
+  if (njobmax <= j)
+    njobmax = j + 1;
+  return j;
+}
 
-  /* If none found, allocate new one. */
-  jobs = realloc(jobs, sizeof(job_t) * (njobmax + 1));
-  memset(&jobs[njobmax], 0, sizeof(job_t));
-  return njobmax++;
+static void freejob(int j) {
+  bit_clear(jobmap, j);
+  if (jobhint > j)
+    jobhint = j;
 }
 
 static int allocproc(int j) {
   job_t *job = &jobs[j];
-  job->proc = realloc(job->proc, sizeof(proc_t) * (job->nproc + 1));
+  int n = job->nproc;
+  /* Capacity is the next power of two, so it need not be stored. */
+  if (powerof2(n))
+    job->proc = arena_realloc(&job->arena, job->proc, sizeof(proc_t) * n,
+                              sizeof(proc_t) * (n ? n * 2 : 1));
   return job->nproc++;
 }
 
 int addjob(pid_t pgid, int bg) {
-  int j = bg ? allocjob() : FG;
+  int j = !bg ? FG : admitted ? admitted : allocjob();
+  if (bg)
+    admitted = 0;
   job_t *job = &jobs[j];
   /* Initial state of a job. */
   job->pgid = pgid;
@@ -110,52 +320,129 @@ int addjob(pid_t pgid, int bg) {
   job->command = NULL;
   job->proc = NULL;
   job->nproc = 0;
+  memset(job->nstate, 0, sizeof(job->nstate));
   job->tmodes = shell_tmodes;
+  job->killed = false;
+  job->cutoff = opt_cutoff;
+  job->queued = NULL;
   return j;
 }
 
 static void deljob(job_t *job) {
   assert(job->state == FINISHED);
-  free(job->command);
-  free(job->proc);
+
+  for (int p = 0; p < job->nproc; p++)
+    if (job->proc[p].ent)
+      RB_REMOVE(pidtree, &pidtree, job->proc[p].ent);
+  if (job != &jobs[FG] && !job->killed)
+    nunreported--;
+
+  if (job != &jobs[FG])
+    freejob(job - jobs);
+
+  /* Foreground slot is used over and over, so it keeps its memory. */
+  if (job == &jobs[FG])
+    arena_reset(&job->arena);
+  else
+    arena_free(&job->arena);
   job->pgid = 0;
   job->command = NULL;
   job->proc = NULL;
   job->nproc = 0;
 }
 
+/* Removes job `j` from run queue and frees its slot. */
+static void unqueuejob(int j) {
+  job_t *job = &jobs[j];
+  TAILQ_REMOVE(&runqueue, job->queued, link);
+  nqueued--;
+  freejob(j);
+  arena_free(&job->arena);
+  job->pgid = 0;
+  job->state = FINISHED;
+  job->command = NULL;
+  job->queued = NULL;
+}
+
+/* Index of processes tells which slot they're in, so when a job changes its
+ * slot this has to be updated too. */
 static void movejob(int from, int to) {
   assert(jobs[to].pgid == 0);
+  arena_free(&jobs[to].arena);
   memcpy(&jobs[to], &jobs[from], sizeof(job_t));
   memset(&jobs[from], 0, sizeof(job_t));
+  if (from != FG)
+    freejob(from);
+  job_t *job = &jobs[to];
+  for (int p = 0; p < job->nproc; p++)
+    if (job->proc[p].ent)
+      job->proc[p].ent->job = to;
 }
 
-static void mkcommand(char **cmdp, char **argv) {
-  if (*cmdp)
-    strapp(cmdp, " | ");
+/* Textual representation of `argv`, words are separated by spaces. */
+static char *mkcommand(arena_t *arena, char **argv) {
+  size_t size = 0;
+  for (char **arg = argv; *arg; arg++)
+    size += strlen(*arg) + 1;
+
+  char *cmd = arena_alloc(arena, size ? size : 1);
+  char *end = cmd;
+  *end = '\0';
 
-  for (strapp(cmdp, *argv++); *argv; argv++) {
-    strapp(cmdp, " ");
-    strapp(cmdp, *argv);
+  for (char **arg = argv; *arg; arg++) {
+    if (arg != argv)
+      *end++ = ' ';
+    end = stpcpy(end, *arg);
   }
+
+  return cmd;
 }
 
-void addproc(int j, pid_t pid, char **argv) {
+void addproc(int j, pid_t pid, char **argv, bool piped) {
   assert(j < njobmax);
   job_t *job = &jobs[j];
 
   int p = allocproc(j);
   proc_t *proc = &job->proc[p];
-  /* Initial state of a process. */
+  /* Initial state of a process. Pipeline stage that was not found has no
+   * process, so it's as if it has already exited with status 127. */
   proc->pid = pid;
-  proc->state = RUNNING;
-  proc->exitcode = -1;
-  mkcommand(&job->command, argv);
+  proc->state = pid ? RUNNING : FINISHED;
+  proc->exitcode = pid ? -1 : W_EXITCODE(127, 0);
+  proc->ent = NULL;
+  proc->command = mkcommand(&job->arena, argv);
+  proc->piped = piped;
+  proc->cut = false;
+  job->nstate[proc->state]++;
+  job->command = NULL;
+
+  if (pid == 0)
+    return;
+
+  /* Pid of a finished process that has not been reported yet may have been
+   * reused, then the entry is taken over by the new process. Changes of the
+   * old one must be applied before that. */
+  drain();
+
+  pident_t *ent = arena_alloc(&job->arena, sizeof(pident_t));
+  ent->pid = pid;
+  ent->job = j;
+  ent->proc = p;
+
+  pident_t *old = RB_FIND(pidtree, &pidtree, ent);
+  if (old) {
+    RB_REMOVE(pidtree, &pidtree, old);
+    jobs[old->job].proc[old->proc].ent = NULL;
+  }
+
+  RB_INSERT(pidtree, &pidtree, ent);
+  proc->ent = ent;
 }
 
 /* Returns job's state.
  * If it's finished, delete it and return exitcode through statusp. */
-static int jobstate(int j, int *statusp) {
+int jobstate(int j, int *statusp) {
+  drain();
   assert(j < njobmax);
   job_t *job = &jobs[j];
   int state = job->state;
@@ -173,21 +460,63 @@ static int jobstate(int j, int *statusp) {
   return state;
 }
 
+/* Returns true if job has been stopped, i.e. none of its processes is running
+ * and some have not finished. */
+bool jobstopped(int j) {
+  drain();
+  assert(j < njobmax);
+  return jobs[j].state == STOPPED;
+}
+
+/* Command line of a pipeline is only needed when job is reported, so it's
+ * put together from commands of processes when asked for the first time. */
 char *jobcmd(int j) {
   assert(j < njobmax);
   job_t *job = &jobs[j];
+
+  if (job->command == NULL) {
+    size_t size = 0;
+    for (int p = 0; p < job->nproc; p++)
+      size += strlen(job->proc[p].command) + 3;
+
+    char *end = job->command = arena_alloc(&job->arena, size);
+    for (int p = 0; p < job->nproc; p++) {
+      if (p > 0)
+        end = stpcpy(end, " | ");
+      end = stpcpy(end, job->proc[p].command);
+    }
+  }
+
   return job->command;
 }
 
+#ifdef STUDENT
+/* Send signal `sig` to all processes of a job. Without job control they share
+ * process group with the shell, so each one is signalled separately. */
+static void signaljob(job_t *job, int sig) {
+  if (interactive) {
+    Kill(-job->pgid, sig);
+    return;
+  }
+
+  for (int p = 0; p < job->nproc; p++)
+    if (job->proc[p].state != FINISHED)
+      (void)kill(job->proc[p].pid, sig);
+}
+#endif /* !STUDENT */
+
 /* Continues a job that has been stopped. If move to foreground was requested,
  * then move the job to foreground and start monitoring it. */
 bool resumejob(int j, int bg, sigset_t *mask) {
+  drain();
   if (j < 0) {
-    for (j = njobmax - 1; j > 0 && jobs[j].state == FINISHED; j--)
+    for (j = njobmax - 1; j > 0 && (jobs[j].state == FINISHED ||
+                                    jobs[j].state == QUEUED); j--)
       continue;
   }
 
-  if (j >= njobmax || jobs[j].state == FINISHED)
+  /* Queued job has not started yet, so there's nothing to resume. */
+  if (j >= njobmax || jobs[j].state == FINISHED || jobs[j].state == QUEUED)
     return false;
 
     /* TODO: Continue stopped job. Possibly move job to foreground slot. */
@@ -198,15 +527,17 @@ bool resumejob(int j, int bg, sigset_t *mask) {
   job_t *job = &jobs[j];
 
   if (!bg) {
-    printf("continue '%s'\n", job->command);
+    printf("continue '%s'\n", jobcmd(j));
     // send to fg, give terminal before SIGCONT, set terminal attributes
     setfgpgrp(job->pgid);
-    Tcsetattr(tty_fd, TCSADRAIN, &jobs[j].tmodes);
-    movejob(j, 0);
+    if (tty_fd >= 0)
+      Tcsetattr(tty_fd, TCSADRAIN, &jobs[j].tmodes);
+    movejob(j, FG);
+    job = &jobs[FG];
   }
   // run job
   job->state = RUNNING;
-  Kill(-job->pgid, SIGCONT);
+  signaljob(job, SIGCONT);
 
   // if fg monitor job
   if (!bg) {
@@ -220,61 +551,261 @@ bool resumejob(int j, int bg, sigset_t *mask) {
 
 /* Kill the job by sending it a SIGTERM. */
 bool killjob(int j) {
+  drain();
   if (j >= njobmax || jobs[j].state == FINISHED)
     return false;
-  debug("[%d] killing '%s'\n", j, jobs[j].command);
+  debug("[%d] killing '%s'\n", j, jobcmd(j));
+
+  /* Job that has not started yet just leaves run queue. */
+  if (jobs[j].state == QUEUED) {
+    unqueuejob(j);
+    return true;
+  }
 
   /* TODO: I love the smell of napalm in the morning. */
 #ifdef STUDENT
   job_t *job = &jobs[j];
-  Kill(-job->pgid, SIGTERM);
+  job->killed = true;
+  signaljob(job, SIGTERM);
   // allow stopped proccesses to receive SIGTERM
-  Kill(-job->pgid, SIGCONT);
+  signaljob(job, SIGCONT);
 #endif /* !STUDENT */
 
   return true;
 }
 
-/* Report state of requested background jobs. Clean up finished jobs. */
-void watchjobs(int which) {
+#ifdef STUDENT
+/* Print state of a job or a process identified by `what`. */
+static void report(const char *what, int state, int status, const char *cmd) {
+  if (state == FINISHED) {
+    if (WIFEXITED(status)) {
+      printf("%s %s '%s', status=%d\n", what, "exited", cmd,
+             WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+      printf("%s %s '%s' by signal %d\n", what, "killed", cmd,
+             WTERMSIG(status));
+    }
+  } else if (state == STOPPED) {
+    printf("%s %s '%s'\n", what, "suspended", cmd);
+  } else if (state == RUNNING) {
+    printf("%s %s '%s'\n", what, "running", cmd);
+  } else if (state == QUEUED) {
+    printf("%s %s '%s'\n", what, "queued", cmd);
+  }
+}
+#endif /* !STUDENT */
+
+/* Report state of requested background jobs. Clean up finished jobs.
+ * If `procs` is set, then state of each process is reported as well. */
+void watchjobs(int which, bool procs) {
+  drain();
   for (int j = BG; j < njobmax; j++) {
     if (jobs[j].pgid == 0)
       continue;
 
       /* TODO: Report job number, state, command and exit code or signal. */
 #ifdef STUDENT
-    // int status;
     if (jobs[j].state == which || which == ALL) {
-      int state;
-      int *statusp = Malloc(sizeof(int));
-
-      // save job command
-      const char *cmd = strdup(jobs[j].command);
-
-      // jobstate removes FINISHED
-      if ((state = jobstate(j, statusp)) == FINISHED) {
-        if (WIFEXITED(*statusp)) {
-          printf("[%d] %s '%s', status=%d\n", j, "exited", cmd,
-                 WEXITSTATUS(*statusp));
-        } else if (WIFSIGNALED(*statusp)) {
-          printf("[%d] %s '%s' by signal %d\n", j, "killed", cmd,
-                 WTERMSIG(*statusp));
-        }
-      } else if (state == STOPPED) {
-        printf("[%d] %s '%s'\n", j, "suspended", cmd);
-      } else if (state == RUNNING) {
-        printf("[%d] %s '%s'\n", j, "running", cmd);
+      job_t *job = &jobs[j];
+      int state = job->state;
+      char what[16];
+
+      // command text goes away with the job, so report before removing it
+      snprintf(what, sizeof(what), "[%d]", j);
+      report(what, state, exitcode(job), jobcmd(j));
+
+      for (int p = 0; procs && p < job->nproc; p++) {
+        proc_t *proc = &job->proc[p];
+        if (proc->pid)
+          snprintf(what, sizeof(what), "%8d", proc->pid);
+        else
+          snprintf(what, sizeof(what), "%8s", "-"); // was not found
+        report(what, proc->state, proc->exitcode, proc->command);
       }
 
-      free(statusp);
-      free((void *)cmd);
+      // jobstate removes FINISHED
+      if (state == FINISHED)
+        (void)jobstate(j, NULL);
     }
 #endif /* !STUDENT */
   }
 }
 
+/* Clean up finished background jobs without reporting them, since shell
+ * without job control does not notify the user about them. */
+void reapjobs(void) {
+  drain();
+  for (int j = BG; j < njobmax; j++)
+    if (jobs[j].pgid != 0 && jobs[j].state == FINISHED)
+      (void)jobstate(j, NULL);
+}
+
+/* Change signal sent by `cutoff` to processes of job `j`, 0 turns it off. */
+bool cutoffjob(int j, int sig) {
+  drain();
+  if (j < BG || j >= njobmax || jobs[j].state == FINISHED)
+    return false;
+  jobs[j].cutoff = sig;
+  return true;
+}
+
+/* Display how many processes were signalled by `cutoff` and how much CPU time
+ * they had used in total. Time they would have gone on for is not known, see
+ * bench-cutoff.py for that. */
+void printcutoffs(void) {
+  printf("cutoff: %u processes, %.3fs of CPU time used by them\n", ncutoff,
+         cutoffused);
+}
+
+/* Returns share of time some task waited for CPU recently, or 0 if kernel
+ * does not tell (it's Linux 4.20+ built with CONFIG_PSI). */
+static double cpupressure(void) {
+  double avg10 = 0.0;
+  FILE *f = fopen("/proc/pressure/cpu", "re");
+  if (f != NULL) {
+    if (fscanf(f, "some avg10=%lf", &avg10) != 1)
+      avg10 = 0.0;
+    fclose(f);
+  }
+  return avg10;
+}
+
+static int nrunning(void) {
+  int n = 0;
+  for (int j = BG; j < njobmax; j++)
+    if (jobs[j].pgid != 0 && jobs[j].state == RUNNING)
+      n++;
+  return n;
+}
+
+/* Returns true if one more background job may run. Stopped jobs do not count,
+ * and a job is always let in when none runs, so the queue cannot get stuck. */
+static bool admissible(void) {
+  if (opt_bglimit == 0)
+    return true;
+  int n = nrunning();
+  if (n >= opt_bglimit)
+    return false;
+  return n == 0 || !opt_bgpressure || cpupressure() < PRESSURE_MAX;
+}
+
+static pipeline_t *copypipeline(arena_t *arena, pipeline_t *pl) {
+  size_t size = sizeof(pipeline_t) + sizeof(stage_t) * pl->nstages;
+  pipeline_t *new = arena_alloc(arena, size);
+  memcpy(new, pl, size);
+
+  for (int i = 0; i < pl->nstages; i++) {
+    stage_t *stage = &new->stage[i];
+    char **argv = arena_alloc(arena, sizeof(char *) * (stage->argc + 1));
+    for (int k = 0; k < stage->argc; k++)
+      argv[k] = arena_strdup(arena, stage->argv[k]);
+    argv[stage->argc] = NULL;
+    stage->argv = argv;
+    if (stage->input)
+      stage->input = arena_strdup(arena, stage->input);
+    if (stage->output)
+      stage->output = arena_strdup(arena, stage->output);
+  }
+
+  return new;
+}
+
+/* Background pipeline `pl` is put in run queue, if as many jobs as allowed
+ * already run or others wait before it. Returns its job number, or -1 if it
+ * may start right away. */
+int queuejob(pipeline_t *pl) {
+  drain();
+  if (TAILQ_EMPTY(&runqueue) && admissible())
+    return -1;
+
+  int j = allocjob();
+  job_t *job = &jobs[j];
+  /* There are no processes to signal, see `killjob`. */
+  job->pgid = -1;
+  job->state = QUEUED;
+  job->proc = NULL;
+  job->nproc = 0;
+  memset(job->nstate, 0, sizeof(job->nstate));
+  job->killed = false;
+  job->cutoff = opt_cutoff;
+
+  qent_t *ent = arena_alloc(&job->arena, sizeof(qent_t));
+  ent->job = j;
+  ent->pipe = copypipeline(&job->arena, pl);
+  job->queued = ent;
+
+  /* Command is shown by `jobs` just like the one of a running pipeline. */
+  char **cmds = arena_alloc(&job->arena, sizeof(char *) * (pl->nstages * 2));
+  for (int i = 0; i < pl->nstages; i++) {
+    cmds[i * 2] = mkcommand(&job->arena, pl->stage[i].argv);
+    cmds[i * 2 + 1] = i + 1 < pl->nstages ? "|" : NULL;
+  }
+  job->command = mkcommand(&job->arena, cmds);
+
+  TAILQ_INSERT_TAIL(&runqueue, ent, link);
+  nqueued++;
+  return j;
+}
+
+/* Returns pipeline of the first job in run queue if it may start now, or NULL
+ * otherwise. Job keeps its number, as its slot is taken by the next `addjob`
+ * of a background job. Pipeline stays valid until the slot is freed. */
+pipeline_t *admitjob(void) {
+  drain();
+
+  /* Previous one did not start, since none of its commands was found. */
+  if (admitted) {
+    freejob(admitted);
+    arena_free(&jobs[admitted].arena);
+    admitted = 0;
+  }
+
+  qent_t *ent = TAILQ_FIRST(&runqueue);
+  if (ent == NULL || !admissible())
+    return NULL;
+
+  TAILQ_REMOVE(&runqueue, ent, link);
+  nqueued--;
+
+  job_t *job = &jobs[ent->job];
+  job->pgid = 0;
+  job->state = FINISHED;
+  job->queued = NULL;
+  admitted = ent->job;
+  return ent->pipe;
+}
+
+/* Returns number of jobs in run queue. */
+int queuedjobs(void) {
+  return nqueued;
+}
+
+/* Returns true if first job in run queue may start now. */
+bool queuedready(void) {
+  drain();
+  return nqueued > 0 && admissible();
+}
+
+/* Display limit of running background jobs and how many wait for it. */
+void printbglimit(void) {
+  drain();
+  if (opt_bglimit == 0)
+    printf("bglimit: off");
+  else
+    printf("bglimit: %d%s", opt_bglimit, opt_bgpressure ? " pressure" : "");
+  printf(", %d running, %d queued\n", nrunning(), nqueued);
+}
+
+/* Returns true if any background job has finished on its own, i.e. without
+ * being killed by the user, and hasn't been reported yet. */
+bool jobsfinished(void) {
+  drain();
+  return nunreported > 0;
+}
+
 /* Monitor job execution. If it gets stopped move it to background.
- * When a job has finished or has been stopped move shell to foreground. */
+ * When a job has finished or has been stopped move shell to foreground.
+ * Returns exit status of the job. */
 int monitorjob(sigset_t *mask) {
   int exitcode = 0, state;
 
@@ -283,7 +814,8 @@ int monitorjob(sigset_t *mask) {
 
   // wait for a foreground job to finish or to be stopped,
   // that is all job processes finish or all stop.
-  while ((state = jobstate(FG, NULL)) == RUNNING) {
+  int status;
+  while ((state = jobstate(FG, &status)) == RUNNING) {
     // wait for some process to change state from running, it can only happen
     // after sigchld_handler is run
     Sigsuspend(mask);
@@ -291,11 +823,18 @@ int monitorjob(sigset_t *mask) {
   // set shell to foreground
   setfgpgrp(getpgrp());
   // put back terminal attributes
-  Tcsetattr(tty_fd, TCSAFLUSH, &shell_tmodes);
+  if (tty_fd >= 0)
+    Tcsetattr(tty_fd, TCSAFLUSH, &shell_tmodes);
 
   if (state == STOPPED) {
     // move job to background
     movejob(FG, allocjob());
+    exitcode = 128 + SIGTSTP;
+  } else if (WIFSIGNALED(status)) {
+    // like other shells report death by signal as exit status above 128
+    exitcode = 128 + WTERMSIG(status);
+  } else {
+    exitcode = WEXITSTATUS(status);
   }
 
 #endif /* !STUDENT */
@@ -316,10 +855,17 @@ void initjobs(void) {
   sigaddset(&act.sa_mask, SIGINT);
   Sigaction(SIGCHLD, &act, NULL);
 
-  jobs = calloc(sizeof(job_t), 1);
+  jobs = Calloc(njobcap, sizeof(job_t));
+  jobmap = bit_alloc(njobcap);
+  bit_set(jobmap, FG);
+
+  /* Without job control all processes stay in shell's process group and the
+   * terminal (if there's any) is left alone. */
+  if (!interactive)
+    return;
 
-  /* Assume we're running in interactive mode, so move us to foreground.
-   * Duplicate terminal fd, but do not leak it to subprocesses that execve. */
+  /* In interactive mode move us to foreground. Duplicate terminal fd,
+   * but do not leak it to subprocesses that execve. */
   assert(isatty(STDIN_FILENO));
   tty_fd = Dup(STDIN_FILENO);
   fcntl(tty_fd, F_SETFD, FD_CLOEXEC);
@@ -351,6 +897,7 @@ void shutdownjobs(void) {
   // wait for a background jobs to finish,
   while (1) {
     // all jobs finished?
+    drain();
     bool bl = true;
     for (int j = 0; j < njobmax; j++) {
       if (jobs[j].pgid != 0 && jobs[j].state != FINISHED) {
@@ -369,14 +916,21 @@ void shutdownjobs(void) {
 
 #endif /* !STUDENT */
 
-  watchjobs(FINISHED);
+  watchjobs(FINISHED, false);
 
   Sigprocmask(SIG_SETMASK, &mask, NULL);
 
-  Close(tty_fd);
+  if (tty_fd >= 0)
+    Close(tty_fd);
 }
 
-/* Sets foreground process group to `pgid`. */
+/* Sets foreground process group to `pgid`. Does nothing without job control. */
 void setfgpgrp(pid_t pgid) {
-  Tcsetpgrp(tty_fd, pgid);
+  if (tty_fd >= 0)
+    Tcsetpgrp(tty_fd, pgid);
+}
+
+/* Returns controlling terminal file descriptor. */
+int ttyfd(void) {
+  return tty_fd;
 }
@@ -1,5 +1,9 @@
 #include "shell.h"
 
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 void strapp(char **dstp, const char *src) {
   assert(dstp != NULL);
 
@@ -12,65 +16,250 @@ void strapp(char **dstp, const char *src) {
   }
 }
 
-token_t *tokenize(char *s, int *tokc_p) {
+/* Whitespace (as told by isspace in C locale) separates words. Word ends at
+ * space, an operator or end of string. */
+#define WORDEND " |&<>;!"
+
+/* Lexer is on the hot path, so make sure it's inlined even with -Og. */
+#define INLINE inline __attribute__((always_inline))
+
+/* Vectorized scanners classify lines 64 characters at a time into bitmaps of
+ * whitespace and characters that end a word. Without one the line is scanned
+ * character by character. */
+typedef struct scanner {
+  const char *isa; /* instruction set used by scanner */
+  void (*block)(const char *s, uint64_t *spaces, uint64_t *ends);
+} scanner_t;
+
+#ifdef __SSE2__
+#define AVX2 __attribute__((target("avx2")))
+
+/* Returns mask of whitespace bytes in `v`, i.e. ' ' or in ['\t', '\r']. */
+static INLINE uint32_t spaces_sse2(__m128i v) {
+  __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+  __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t);
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+  return _mm_movemask_epi8(m);
+}
+
+/* Returns mask of bytes in `v` that end a word. */
+static INLINE uint32_t wordends_sse2(__m128i v) {
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+                           _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('!')));
+  return _mm_movemask_epi8(m);
+}
+
+static void block_sse2(const char *s, uint64_t *spaces, uint64_t *ends) {
+  uint64_t sp = 0, end = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    sp |= (uint64_t)spaces_sse2(v) << i;
+    end |= (uint64_t)wordends_sse2(v) << i;
+  }
+  *spaces = sp;
+  *ends = end;
+}
+
+AVX2 static INLINE uint32_t spaces_avx2(__m256i v) {
+  __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+  __m256i m =
+    _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t);
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+  return _mm256_movemask_epi8(m);
+}
+
+AVX2 static INLINE uint32_t wordends_avx2(__m256i v) {
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()),
+                              _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('!')));
+  return _mm256_movemask_epi8(m);
+}
+
+AVX2 static void block_avx2(const char *s, uint64_t *spaces, uint64_t *ends) {
+  __m256i lo = _mm256_loadu_si256((const __m256i *)s);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(s + 32));
+  *spaces = spaces_avx2(lo) | (uint64_t)spaces_avx2(hi) << 32;
+  *ends = wordends_avx2(lo) | (uint64_t)wordends_avx2(hi) << 32;
+}
+#endif /* !__SSE2__ */
+
+static const scanner_t scanners[] = {
+  {"scalar", NULL},
+#ifdef __SSE2__
+  {"sse2", block_sse2},
+  {"avx2", block_avx2},
+#endif
+  {NULL, NULL},
+};
+
+static const scanner_t *scanner = NULL;
+
+static bool supported(const scanner_t *sc) {
+#ifdef __SSE2__
+  if (!strcmp(sc->isa, "avx2"))
+    return __builtin_cpu_supports("avx2");
+#endif
+  return true;
+}
+
+/* Choose character class scanner used by `tokenize`. If `isa` is NULL the
+ * best one supported by the processor is used. Returns false if `isa` is not
+ * known or not supported. */
+bool uselexer(const char *isa) {
+  const scanner_t *best = NULL;
+
+  for (const scanner_t *sc = scanners; sc->isa; sc++) {
+    if (!supported(sc))
+      continue;
+    if (isa == NULL || !strcmp(sc->isa, isa))
+      best = sc;
+  }
+
+  if (best)
+    scanner = best;
+  return best != NULL;
+}
+
+/* Fill in bitmaps for string `s` of length `n`, including its terminating
+ * NUL. Last block is copied, so that scanner never reads past the string. */
+static void classify(const char *s, size_t n, uint64_t *spaces,
+                     uint64_t *ends) {
+  size_t k = 0;
+
+  for (; k * 64 + 64 <= n; k++)
+    scanner->block(s + k * 64, &spaces[k], &ends[k]);
+
+  char last[64] = {};
+  memcpy(last, s + k * 64, n - k * 64);
+  scanner->block(last, &spaces[k], &ends[k]);
+}
+
+/* Position of first bit set in `map` at or after `i`. */
+static INLINE size_t nextset(const uint64_t *map, size_t i) {
+  size_t k = i / 64;
+  uint64_t w = map[k] & (~UINT64_C(0) << (i % 64));
+  while (w == 0)
+    w = map[++k];
+  return k * 64 + __builtin_ctzll(w);
+}
+
+/* Position of first bit clear in `map` at or after `i`. */
+static INLINE size_t nextclear(const uint64_t *map, size_t i) {
+  size_t k = i / 64;
+  uint64_t w = ~map[k] & (~UINT64_C(0) << (i % 64));
+  while (w == 0)
+    w = ~map[++k];
+  return k * 64 + __builtin_ctzll(w);
+}
+
+/* Tells if character at `i` is whitespace. */
+static INLINE bool isspace_at(const char *s, const uint64_t *spaces,
+                              size_t i) {
+  if (spaces == NULL)
+    return isspace(s[i]);
+  return spaces[i / 64] & (UINT64_C(1) << (i % 64));
+}
+
+/* Returns end of whitespace run that starts at `i`. */
+static INLINE size_t skipspace(const char *s, const uint64_t *spaces,
+                               size_t i) {
+  if (spaces == NULL) {
+    while (isspace(s[++i]))
+      continue;
+    return i;
+  }
+  return nextclear(spaces, i);
+}
+
+/* Returns end of word that starts at `i`. */
+static INLINE size_t wordend(const char *s, const uint64_t *ends, size_t i) {
+  if (ends == NULL)
+    return i + strcspn(s + i, WORDEND);
+  return nextset(ends, i);
+}
+
+/* Splits line `s` into tokens. Line is not modified, so a token refers to
+ * characters of the line by their position. Token array is terminated with
+ * T_NULL token and allocated from `arena`. */
+token_t *tokenize(const char *s, int *tokc_p, arena_t *arena) {
   int capacity = 10;
   int ntoks = 0;
 
-  token_t *tokvec = malloc(sizeof(token_t) * (capacity + 1));
+  token_t *tokvec = arena_alloc(arena, sizeof(token_t) * (capacity + 1));
+
+  if (scanner == NULL)
+    (void)uselexer(NULL);
+
+  /* Terminating NUL ends a word and is not a space, so both searches below
+   * stop at the end of string at the latest. */
+  uint64_t *spaces = NULL, *ends = NULL;
 
-  while (*s != 0) {
+  if (scanner->block) {
+    size_t n = strlen(s);
+    size_t nblocks = n / 64 + 1;
+    spaces = arena_alloc(arena, sizeof(uint64_t) * nblocks);
+    ends = arena_alloc(arena, sizeof(uint64_t) * nblocks);
+    classify(s, n, spaces, ends);
+  }
+
+  size_t i = 0;
+
+  while (s[i] != 0) {
     /* Consume whitespace characters. */
-    if (isspace(*s)) {
-      *s++ = 0;
+    if (isspace_at(s, spaces, i)) {
+      i = skipspace(s, spaces, i);
       continue;
     }
 
     /* Make sure there's enough space to add new token. */
     if (ntoks == capacity) {
+      tokvec = arena_realloc(arena, tokvec, sizeof(token_t) * (capacity + 1),
+                             sizeof(token_t) * (capacity * 2 + 1));
       capacity *= 2;
-      tokvec = realloc(tokvec, sizeof(token_t) * (capacity + 1));
     }
 
-    size_t l = strcspn(s, " |&<>;!");
-    if (l > 0) {
-      tokvec[ntoks++] = s;
-      s += l;
+    token_t *tok = &tokvec[ntoks++];
+    size_t end = wordend(s, ends, i);
+
+    tok->offset = i;
+
+    if (end > i) {
+      tok->kind = T_WORD;
+      tok->length = end - i;
+      i = end;
       continue;
     }
 
-    token_t tok;
-
-    if (s[0] == '|') {
-      if (s[1] == '|') {
-        *s++ = 0;
-        tok = T_OR;
-      } else {
-        tok = T_PIPE;
-      }
-    } else if (s[0] == '&') {
-      if (s[1] == '&') {
-        *s++ = 0;
-        tok = T_AND;
-      } else {
-        tok = T_BGJOB;
-      }
-    } else if (s[0] == '<') {
-      tok = T_INPUT;
-    } else if (s[0] == '>') {
-      tok = T_OUTPUT;
-    } else if (s[0] == ';') {
-      tok = T_COLON;
-    } else if (s[0] == '!') {
-      tok = T_BANG;
+    if (s[i] == '|') {
+      tok->kind = s[i + 1] == '|' ? T_OR : T_PIPE;
+    } else if (s[i] == '&') {
+      tok->kind = s[i + 1] == '&' ? T_AND : T_BGJOB;
+    } else if (s[i] == '<') {
+      tok->kind = T_INPUT;
+    } else if (s[i] == '>') {
+      tok->kind = T_OUTPUT;
+    } else if (s[i] == ';') {
+      tok->kind = T_COLON;
     } else {
-      continue;
+      tok->kind = T_BANG;
     }
 
-    *s++ = 0;
-    tokvec[ntoks++] = tok;
+    tok->length = tok->kind == T_OR || tok->kind == T_AND ? 2 : 1;
+    i += tok->length;
   }
 
-  tokvec[ntoks] = NULL;
+  tokvec[ntoks] = (token_t){.kind = T_NULL, .offset = i, .length = 0};
   *tokc_p = ntoks;
   return tokvec;
 }
@@ -0,0 +1,8 @@
+#include "csapp.h"
+#include <asm/unistd.h>
+
+/* glibc hides pipe2 unless _GNU_SOURCE is defined. */
+void Pipe2(int fds[2], int flags) {
+  if (syscall(__NR_pipe2, fds, flags) < 0)
+    unix_error("Pipe2 error");
+}
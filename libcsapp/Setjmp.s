@@ -43,3 +43,5 @@ Longjmp:
 1:	movq	%r11,(%rsp)
 	ret
         .size Longjmp, . - Longjmp
+
+        .section .note.GNU-stack,"",@progbits
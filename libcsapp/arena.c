@@ -0,0 +1,83 @@
+#include "csapp.h"
+
+#define ARENA_ALIGN sizeof(max_align_t)
+#define ARENA_CHUNK 4096
+
+struct arena_chunk {
+  arena_chunk_t *next; /* previously used chunk */
+  size_t size;         /* number of bytes in data */
+  max_align_t data[];
+};
+
+static size_t arena_round(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+void *arena_alloc(arena_t *a, size_t size) {
+  size = arena_round(size);
+
+  arena_chunk_t *chunk = a->chunk;
+  if (chunk == NULL || a->used + size > chunk->size) {
+    /* Each chunk is at least twice as big as the previous one. */
+    size_t n = max(chunk ? chunk->size * 2 : ARENA_CHUNK, size);
+    chunk = Malloc(sizeof(arena_chunk_t) + n);
+    chunk->next = a->chunk;
+    chunk->size = n;
+    a->chunk = chunk;
+    a->used = 0;
+  }
+
+  a->last = (char *)chunk->data + a->used;
+  a->used += size;
+  return a->last;
+}
+
+void *arena_realloc(arena_t *a, void *ptr, size_t oldsize, size_t size) {
+  /* Most recent allocation can grow or shrink in place. */
+  if (ptr != NULL && ptr == a->last) {
+    size_t start = (char *)ptr - (char *)a->chunk->data;
+    if (start + arena_round(size) <= a->chunk->size) {
+      a->used = start + arena_round(size);
+      return ptr;
+    }
+  }
+
+  void *new = arena_alloc(a, size);
+  if (ptr != NULL)
+    memcpy(new, ptr, min(oldsize, size));
+  return new;
+}
+
+char *arena_strdup(arena_t *a, const char *s) {
+  size_t n = strlen(s) + 1;
+  return memcpy(arena_alloc(a, n), s, n);
+}
+
+void arena_reset(arena_t *a) {
+  arena_chunk_t *chunk = a->chunk;
+  if (chunk == NULL)
+    return;
+
+  /* Keep the last chunk, as it's the biggest one. */
+  arena_chunk_t *next;
+  for (arena_chunk_t *old = chunk->next; old; old = next) {
+    next = old->next;
+    free(old);
+  }
+
+  chunk->next = NULL;
+  a->used = 0;
+  a->last = NULL;
+}
+
+void arena_free(arena_t *a) {
+  arena_chunk_t *next;
+  for (arena_chunk_t *chunk = a->chunk; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+
+  a->chunk = NULL;
+  a->used = 0;
+  a->last = NULL;
+}
@@ -0,0 +1,256 @@
+#include "shell.h"
+#include <asm/unistd.h>
+#include <sys/ioctl.h>
+
+/* Builtins that move data from one descriptor to another. The kernel is asked
+ * to do it without copying data to user space and back: splice(2) when one of
+ * the descriptors is a pipe, tee(2) to duplicate contents of a pipe and
+ * copy_file_range(2) between regular files. If that cannot be done (e.g. one
+ * of the descriptors is a terminal), data is read into a buffer and written
+ * out. Non-blocking descriptors are fine, since waiting is done by `cowait`. */
+
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#endif
+
+#define CHUNK 65536
+#define MAXMOVE (1 << 30) /* as much as the kernel is willing to move at once */
+
+static bool ispipe(int fd) {
+  struct stat sb;
+  Fstat(fd, &sb);
+  return S_ISFIFO(sb.st_mode);
+}
+
+static bool isreg(int fd) {
+  struct stat sb;
+  Fstat(fd, &sb);
+  return S_ISREG(sb.st_mode);
+}
+
+/* Errors that mean zero-copy is not available for given descriptors. */
+static bool unsupported(int error) {
+  return error == EINVAL || error == ENOSYS || error == EXDEV ||
+         error == EOPNOTSUPP || error == EBADF;
+}
+
+/* Wait until data can be moved between `in` and `out`, where at least one is
+ * a non-blocking pipe. Either input pipe is empty or output pipe is full.
+ * Returns false if we have to give up, see `cowait`. */
+static bool waitmove(int in, int out) {
+  int n;
+  if (ispipe(in) && ioctl(in, FIONREAD, &n) == 0 && n == 0)
+    return cowait(in, POLLIN);
+  return cowait(out, POLLOUT);
+}
+
+/* Returns number of bytes moved like splice(2) does, but never fails with
+ * EAGAIN. Reading stops after `len` bytes, or at end of file. */
+static ssize_t dosplice(int in, int out, size_t len) {
+  for (;;) {
+    ssize_t n = syscall(__NR_splice, in, NULL, out, NULL, len, SPLICE_F_MOVE);
+    if (n >= 0 || errno != EAGAIN)
+      return n;
+    if (!waitmove(in, out))
+      return -1;
+  }
+}
+
+/* Like `dosplice`, but duplicates data of `in` pipe instead of consuming it. */
+static ssize_t dotee(int in, int out, size_t len) {
+  for (;;) {
+    ssize_t n = syscall(__NR_tee, in, out, len, 0);
+    if (n >= 0 || errno != EAGAIN)
+      return n;
+    if (!waitmove(in, out))
+      return -1;
+  }
+}
+
+/* Copy `len` bytes (or all if -1) through user space. Returns number of bytes
+ * copied or -1 on error. */
+static ssize_t copy(int in, int out, ssize_t len) {
+  char *buf = Malloc(CHUNK);
+  ssize_t done = 0, n = 0;
+
+  while (len < 0 || done < len) {
+    size_t want = len < 0 ? CHUNK : min((size_t)(len - done), (size_t)CHUNK);
+    if ((n = coread(in, buf, want)) <= 0)
+      break;
+    if ((n = cowrite(out, buf, n)) < 0)
+      break;
+    done += n;
+  }
+
+  free(buf);
+  return n < 0 ? -1 : done;
+}
+
+/* Move everything from `in` to `out`. Returns false on failure. */
+static bool move(int in, int out) {
+  ssize_t n = -1;
+
+  if (ispipe(in) || ispipe(out)) {
+    while ((n = dosplice(in, out, MAXMOVE)) > 0)
+      continue;
+  } else if (isreg(in) && isreg(out)) {
+    while ((n = syscall(__NR_copy_file_range, in, NULL, out, NULL, MAXMOVE,
+                        0)) > 0)
+      continue;
+  } else {
+    errno = EINVAL;
+  }
+
+  /* File offsets were advanced by what was moved, so just go on. */
+  if (n < 0 && unsupported(errno))
+    n = copy(in, out, -1);
+
+  return n >= 0;
+}
+
+/* Consume `len` bytes of `in` pipe, that are already there, into `out`. */
+static bool drain(int in, int out, size_t len) {
+  while (len > 0) {
+    ssize_t n = dosplice(in, out, len);
+    if (n < 0 && unsupported(errno))
+      n = copy(in, out, len);
+    if (n <= 0)
+      return false;
+    len -= n;
+  }
+  return true;
+}
+
+/* Failures that user knows about already. */
+static bool quiet(int error) {
+  return error == EPIPE || error == EINTR;
+}
+
+/* Options are left to external commands. Lone `-` is not an option. */
+static bool nooptions(char **argv) {
+  for (; *argv; argv++)
+    if ((*argv)[0] == '-' && (*argv)[1] != '\0')
+      return false;
+  return true;
+}
+
+bool cat_accepts(char **argv) {
+  return nooptions(argv);
+}
+
+/*
+ * Concatenate files to standard output.
+ * 'cat' - copy standard input
+ * 'cat file ...' - copy files in order, '-' stands for standard input
+ */
+int do_cat(char **argv) {
+  static char *stdin_only[] = {"-", NULL};
+  int output = cofd(STDOUT_FILENO);
+  int rc = 0;
+
+  if (argv[0] == NULL)
+    argv = stdin_only;
+
+  for (; *argv; argv++) {
+    int input = cofd(STDIN_FILENO);
+
+    if (strcmp(*argv, "-") && (input = open(*argv, O_RDONLY | O_CLOEXEC)) < 0) {
+      msg("cat: %s: %s\n", *argv, strerror(errno));
+      rc = 1;
+      continue;
+    }
+
+    bool ok = move(input, output);
+    int error = errno;
+
+    if (input != cofd(STDIN_FILENO))
+      Close(input);
+
+    if (!ok) {
+      rc = 1;
+      /* Reader has gone or user interrupted us, so don't go on. */
+      if (quiet(error))
+        break;
+      msg("cat: %s: %s\n", *argv, strerror(error));
+    }
+  }
+
+  return rc;
+}
+
+/* Duplicate `in` pipe to `out` pipe and `file`, so that data goes to output
+ * without being consumed, and then it's moved to the file. */
+static bool teemove(int in, int out, int file) {
+  ssize_t n;
+  while ((n = dotee(in, out, MAXMOVE)) > 0)
+    if (!drain(in, file, n))
+      return false;
+  return n == 0;
+}
+
+/* Copy `in` to `out` and all `files` through user space. */
+static bool teecopy(int in, int out, int *files, int nfiles) {
+  char *buf = Malloc(CHUNK);
+  ssize_t n;
+
+  while ((n = coread(in, buf, CHUNK)) > 0) {
+    if (cowrite(out, buf, n) < 0)
+      n = -1;
+    for (int i = 0; i < nfiles && n > 0; i++)
+      if (cowrite(files[i], buf, n) < 0)
+        n = -1;
+    if (n < 0)
+      break;
+  }
+
+  free(buf);
+  return n == 0;
+}
+
+bool tee_accepts(char **argv) {
+  return nooptions(argv);
+}
+
+/*
+ * Copy standard input to standard output and to files.
+ * 'tee file ...' - files are truncated first
+ */
+int do_tee(char **argv) {
+  int input = cofd(STDIN_FILENO);
+  int output = cofd(STDOUT_FILENO);
+  int argc = 0, nfiles = 0, rc = 0;
+
+  while (argv[argc])
+    argc++;
+
+  int files[argc + 1];
+
+  for (int i = 0; i < argc; i++) {
+    int fd = open(argv[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+      msg("tee: %s: %s\n", argv[i], strerror(errno));
+      rc = 1;
+    } else {
+      files[nfiles++] = fd;
+    }
+  }
+
+  bool ok;
+  if (nfiles == 0)
+    ok = move(input, output);
+  else if (nfiles == 1 && ispipe(input) && ispipe(output))
+    ok = teemove(input, output, files[0]);
+  else
+    ok = teecopy(input, output, files, nfiles);
+
+  if (!ok) {
+    if (!quiet(errno))
+      msg("tee: %s\n", strerror(errno));
+    rc = 1;
+  }
+
+  for (int i = 0; i < nfiles; i++)
+    Close(files[i]);
+
+  return rc;
+}
@@ -0,0 +1,132 @@
+#include "shell.h"
+
+/* Pipelines are rewritten before they're run, so that common idioms do not
+ * cost a process and a copy of data through a pipe:
+ *
+ *   cat file | cmd ...   =>   cmd ... < file
+ *   ... | cmd | cat      =>   ... | cmd
+ *
+ * Rewritten pipeline must behave just like the original one, so each rule
+ * gives up whenever it cannot tell that's the case. Parsed command lines are
+ * cached and never modified, hence rewritten pipeline is a copy. */
+
+/* If set, pipelines are rewritten. */
+bool opt_rewrite = false;
+
+/* If set, rewrites are reported on standard error, including those that would
+ * be done if `opt_rewrite` was set. */
+bool opt_rewritelog = false;
+
+static bool iscat(stage_t *stage) {
+  return !strcmp(stage->argv[0], "cat");
+}
+
+/* Builtins that change shell's state run in a subshell when they're a part
+ * of a pipeline, e.g. `cd dir | cat` must not change directory of the shell.
+ * Returns true if `rest` left alone once cat is removed from `pl` is fine. */
+static bool staysapipeline(pipeline_t *pl, stage_t *rest) {
+  return pl->nstages > 2 || !is_builtin(rest->argv) ||
+         builtin_pipemode(rest->argv) != SUBSHELL;
+}
+
+/* Reading from a file redirected to standard input is the same as reading
+ * from cat, unless it cannot be opened. Then cat prints an error and the next
+ * stage reads nothing, while the shell would fail to redirect. */
+static bool readable(const char *path) {
+  struct stat sb;
+  return access(path, R_OK) == 0 && stat(path, &sb) == 0 &&
+         !S_ISDIR(sb.st_mode);
+}
+
+/* `cat file | cmd` - cat has neither options nor redirections. Pipeline may
+ * be left with one stage once trailing cat was removed. */
+static bool catfile(pipeline_t *pl) {
+  if (pl->nstages < 2)
+    return false;
+  stage_t *cat = &pl->stage[0], *next = &pl->stage[1];
+  return iscat(cat) && cat->argc == 2 && cat->argv[1][0] != '-' &&
+         cat->input == NULL && cat->output == NULL && next->input == NULL &&
+         staysapipeline(pl, next) && readable(cat->argv[1]);
+}
+
+/* `cmd | cat` - cat reads standard input only and writes to a file or to
+ * something other than a terminal, since commands (e.g. ls) tell whether they
+ * write to a terminal and behave differently. Status of a job in background
+ * is reported, so its last process must stay the same. */
+static bool catpipe(pipeline_t *pl) {
+  stage_t *cat = &pl->stage[pl->nstages - 1], *prev = cat - 1;
+  return iscat(cat) &&
+         (cat->argc == 1 || (cat->argc == 2 && !strcmp(cat->argv[1], "-"))) &&
+         cat->input == NULL && prev->output == NULL && !pl->bg &&
+         (cat->output != NULL || !isatty(STDOUT_FILENO)) &&
+         staysapipeline(pl, prev);
+}
+
+static void logstage(stage_t *stage) {
+  for (int i = 0; i < stage->argc; i++)
+    msg("%s%s", i ? " " : "", stage->argv[i]);
+  if (stage->input)
+    msg(" < %s", stage->input);
+  if (stage->output)
+    msg(" > %s", stage->output);
+}
+
+static void logpipeline(pipeline_t *pl) {
+  for (int i = 0; i < pl->nstages; i++) {
+    if (i)
+      msg(" | ");
+    logstage(&pl->stage[i]);
+  }
+}
+
+/* Returns pipeline `pl` rewritten into a copy allocated from `arena`, or `pl`
+ * itself if there's nothing to do. If trailing cat was removed `*catp` is set,
+ * as exit status of the pipeline would have been the one of cat. */
+pipeline_t *optimize(pipeline_t *pl, arena_t *arena, bool *catp) {
+  *catp = false;
+
+  if (!opt_rewrite && !opt_rewritelog)
+    return pl;
+  if (pl->nstages < 2)
+    return pl;
+
+  size_t size = sizeof(pipeline_t) + sizeof(stage_t) * pl->nstages;
+  pipeline_t *new = NULL;
+
+  if (catpipe(pl)) {
+    new = arena_alloc(arena, size);
+    memcpy(new, pl, size);
+    stage_t *cat = &new->stage[--new->nstages];
+    cat[-1].output = cat->output;
+    *catp = true;
+  }
+
+  pipeline_t *cur = new ? new : pl;
+  if (catfile(cur)) {
+    if (new == NULL) {
+      new = arena_alloc(arena, size);
+      memcpy(new, pl, size);
+    }
+    char *file = new->stage[0].argv[1];
+    new->nstages--;
+    memmove(&new->stage[0], &new->stage[1], sizeof(stage_t) * new->nstages);
+    new->stage[0].input = file;
+  }
+
+  if (new == NULL)
+    return pl;
+
+  if (opt_rewritelog) {
+    msg("rewrite%s: ", opt_rewrite ? "" : " (not applied)");
+    logpipeline(pl);
+    msg(" => ");
+    logpipeline(new);
+    msg("\n");
+  }
+
+  if (!opt_rewrite) {
+    *catp = false;
+    return pl;
+  }
+  return new;
+}
@@ -0,0 +1,246 @@
+#include "shell.h"
+
+/* `parallel` runs a command for each line of its input with up to N of them
+ * at once, like `xargs -P`. Every command is a background job of its own in
+ * shell's job table, so a slot is refilled as soon as SIGCHLD tells that a job
+ * has finished. SIGCHLD and SIGINT are kept blocked and taken with sigwaitinfo,
+ * since commands are in process groups of their own and ^C does not reach
+ * them - then they're killed, and no more commands are started. */
+
+typedef struct task {
+  int job;               /* slot in job table or -1 if task slot is free */
+  struct timespec start; /* when the command was started */
+} task_t;
+
+static int cmpdouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted latencies. */
+static double percentile(double *lat, int n, int p) {
+  int i = (n * p + 99) / 100;
+  return lat[i > 0 ? i - 1 : 0];
+}
+
+/* Replace each `{}` in `word` with `item`. */
+static char *substitute(arena_t *arena, const char *word, const char *item) {
+  size_t n = 0, len = strlen(item);
+  for (const char *s = word; (s = strstr(s, "{}")); s += 2)
+    n++;
+
+  char *new = arena_alloc(arena, strlen(word) + n * len - n * 2 + 1);
+  char *end = new;
+  for (const char *s; (s = strstr(word, "{}")); word = s + 2) {
+    memcpy(end, word, s - word);
+    end += s - word;
+    memcpy(end, item, len);
+    end += len;
+  }
+  strcpy(end, word);
+  return new;
+}
+
+/* Arguments of command run for `item`. If `{}` is not found in the template,
+ * item is appended as the last argument. */
+static char **mkargv(arena_t *arena, char **tmpl, const char *item) {
+  int argc = 0;
+  bool found = false;
+  for (; tmpl[argc]; argc++)
+    found |= strstr(tmpl[argc], "{}") != NULL;
+
+  char **argv = arena_alloc(arena, sizeof(char *) * (argc + 2));
+  for (int i = 0; i < argc; i++)
+    argv[i] = substitute(arena, tmpl[i], item);
+  if (!found)
+    argv[argc++] = (char *)item;
+  argv[argc] = NULL;
+  return argv;
+}
+
+/* Items are read without stdio. A builtin command runs in a copy of the shell
+ * that leaves with `exit`, which would move offset of a shared descriptor back
+ * to where stdio stopped reading, and then items would be read again. */
+typedef struct items {
+  int fd;
+  char *buf;
+  size_t cap;   /* size of buffer */
+  size_t start; /* beginning of next item */
+  size_t end;   /* end of data read */
+  bool eof;
+} items_t;
+
+/* Descriptor that items are read from must not leak to commands. */
+static bool openitems(items_t *it, const char *path) {
+  *it = (items_t){.cap = 4096};
+  it->fd = path ? open(path, O_RDONLY | O_CLOEXEC)
+                : fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+  if (it->fd < 0)
+    return false;
+  it->buf = Malloc(it->cap);
+  return true;
+}
+
+static void closeitems(items_t *it) {
+  Close(it->fd);
+  free(it->buf);
+}
+
+/* Reads next non-empty item, returns NULL at the end of input. Last line
+ * need not end with a newline. */
+static char *nextitem(items_t *it) {
+  for (;;) {
+    char *s = it->buf + it->start;
+    char *nl = memchr(s, '\n', it->end - it->start);
+
+    if (nl || (it->eof && it->start < it->end)) {
+      size_t len = nl ? (size_t)(nl - s) : it->end - it->start;
+      s[len] = '\0';
+      it->start += len + 1;
+      if (it->start > it->end)
+        it->start = it->end;
+      if (len > 0)
+        return s;
+      continue;
+    }
+    if (it->eof)
+      return NULL;
+
+    /* Move partial line to the front and make room for more. */
+    it->end -= it->start;
+    memmove(it->buf, s, it->end);
+    it->start = 0;
+    if (it->end + 1 >= it->cap)
+      it->buf = Realloc(it->buf, it->cap *= 2);
+
+    ssize_t n = read(it->fd, it->buf + it->end, it->cap - it->end - 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      it->eof = true;
+    else
+      it->end += n;
+  }
+}
+
+static void report(int ntasks, int nfailed, double *lat, int nlat,
+                   double total) {
+  msg("parallel: %d tasks in %.3fs, %.1f tasks/s", ntasks, total,
+      total > 0 ? ntasks / total : 0.0);
+  if (nlat > 0) {
+    qsort(lat, nlat, sizeof(double), cmpdouble);
+    msg(", latency p50 %.1fms p99 %.1fms", percentile(lat, nlat, 50) * 1e3,
+        percentile(lat, nlat, 99) * 1e3);
+  }
+  msg(", %d failed\n", nfailed);
+}
+
+/*
+ * Run command for each line of input, many of them at once.
+ * 'parallel cmd args...' - one command per CPU, line is appended to arguments
+ * 'parallel -P n cmd ... {} ...' - up to n commands, `{}` is replaced by line
+ * 'parallel -a file cmd ...' - read lines from file rather than standard input
+ */
+int do_parallel(char **argv) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  char *path = NULL;
+
+  for (; argv[0] && argv[1] && argv[0][0] == '-'; argv += 2) {
+    if (!strcmp(argv[0], "-P"))
+      n = atol(argv[1]);
+    else if (!strcmp(argv[0], "-a"))
+      path = argv[1];
+    else
+      break;
+  }
+
+  if (argv[0] == NULL || argv[0][0] == '-' || n <= 0) {
+    msg("parallel: usage: parallel [-P n] [-a file] cmd [args...]\n");
+    return 2;
+  }
+
+  items_t in;
+  if (!openitems(&in, path)) {
+    msg("parallel: %s: %s\n", path ? path : "stdin", strerror(errno));
+    return 1;
+  }
+
+  sigset_t set, mask;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGINT);
+  Sigprocmask(SIG_BLOCK, &set, &mask);
+
+  task_t *task = Malloc(sizeof(task_t) * n);
+  for (int i = 0; i < n; i++)
+    task[i].job = -1;
+
+  arena_t arena = {};
+  double *lat = NULL;
+  int nlat = 0, ntasks = 0, nfailed = 0, nrunning = 0;
+  bool eof = false, stop = false;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (nrunning > 0 || (!eof && !stop)) {
+    /* Fill free slots. */
+    for (int i = 0; i < n && !eof && !stop; i++) {
+      if (task[i].job >= 0)
+        continue;
+
+      char *item = nextitem(&in);
+      if (item == NULL) {
+        eof = true;
+        break;
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &task[i].start);
+      task[i].job = startjob(mkargv(&arena, argv, item));
+      arena_reset(&arena);
+      ntasks++;
+      if (task[i].job < 0)
+        nfailed++;
+      else
+        nrunning++;
+    }
+
+    if (nrunning == 0)
+      continue;
+
+    int sig = sigwaitinfo(&set, NULL);
+    if (sig == SIGCHLD) {
+      childevents();
+    } else if (sig == SIGINT && !stop) {
+      stop = true;
+      for (int i = 0; i < n; i++)
+        if (task[i].job >= 0)
+          (void)killjob(task[i].job);
+    }
+
+    /* Collect finished tasks. */
+    for (int i = 0; i < n; i++) {
+      int status;
+      if (task[i].job < 0 || jobstate(task[i].job, &status) != FINISHED)
+        continue;
+      if (powerof2(nlat))
+        lat = Realloc(lat, sizeof(double) * (nlat ? nlat * 2 : 1));
+      lat[nlat++] = since(&task[i].start);
+      if (status != 0)
+        nfailed++;
+      task[i].job = -1;
+      nrunning--;
+    }
+  }
+
+  report(ntasks, nfailed, lat, nlat, since(&start));
+
+  free(lat);
+  free(task);
+  arena_free(&arena);
+  closeitems(&in);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  if (stop)
+    return 128 + SIGINT;
+  return nfailed ? 1 : 0;
+}
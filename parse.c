@@ -0,0 +1,224 @@
+#include "shell.h"
+
+/* Parsed command lines are remembered, so a line that was seen recently
+ * (e.g. re-run from history or executed in a loop) is neither tokenized nor
+ * parsed again. Cache is flushed as a whole when it gets full. */
+
+#define NBUCKETS 64
+#define MAXCACHED 256
+
+typedef struct cached {
+  struct cached *next; /* next entry in the same bucket */
+  uint32_t hash;       /* hash value of the line */
+  char *line;          /* command line as it was read */
+  cmdline_t *cl;       /* command line after parsing */
+} cached_t;
+
+static arena_t cachearena;         /* memory of cache entries */
+static arena_t tokarena;           /* tokens of the line being parsed */
+static cached_t *cache[NBUCKETS];  /* hash table of parsed lines */
+static unsigned ncached = 0;       /* number of lines in cache */
+static unsigned hits = 0, misses = 0;
+
+static char *copystr(const char *s, size_t n) {
+  char *str = arena_alloc(&cachearena, n + 1);
+  memcpy(str, s, n);
+  str[n] = '\0';
+  return str;
+}
+
+static char *word(const char *line, token_t *tok) {
+  return copystr(line + tok->offset, tok->length);
+}
+
+static bool syntax_error(const char *line, token_t *tok) {
+  if (tok->kind == T_NULL)
+    msg("syntax error near unexpected token `newline'\n");
+  else
+    msg("syntax error near unexpected token `%.*s'\n", tok->length,
+        line + tok->offset);
+  return false;
+}
+
+/* Separators that end a pipeline, as opposed to `|` that connects commands. */
+#define endpipeline_p(kind) (separator_p(kind) && (kind) != T_PIPE)
+
+/* Check that command line is a list of pipelines separated with `;`, `&`, `&&`
+ * or `||`. Each pipeline may start with `!` and consists of commands with at
+ * least one word and optional redirections. */
+static bool wellformed(const char *line, token_t *token, int ntokens) {
+  int argc = 0;
+  bool start = true;  /* `!` is allowed only at start of pipeline */
+  bool andor = false; /* pipeline follows `&&` or `||` */
+
+  for (int i = 0; i < ntokens; i++) {
+    token_t *tok = &token[i];
+
+    if (tok->kind == T_WORD) {
+      argc++;
+    } else if (tok->kind == T_INPUT || tok->kind == T_OUTPUT) {
+      if (i + 1 == ntokens)
+        return syntax_error(line, &(token_t){.kind = T_NULL});
+      if (tok[1].kind != T_WORD)
+        return syntax_error(line, &tok[1]);
+      i++;
+    } else if (tok->kind == T_BANG && start) {
+      /* nothing to do */
+    } else if (tok->kind == T_PIPE && argc > 0) {
+      argc = 0;
+    } else if (endpipeline_p(tok->kind) && argc > 0) {
+      /* Background list would have to be run by a copy of the shell. */
+      if (tok->kind == T_BGJOB && andor) {
+        msg("background `&&' and `||' lists are not supported\n");
+        return false;
+      }
+      andor = tok->kind == T_AND || tok->kind == T_OR;
+      argc = 0;
+      start = true;
+      continue;
+    } else {
+      return syntax_error(line, tok);
+    }
+
+    start = false;
+  }
+
+  /* Only `;` and `&` may end the line. */
+  if ((!start && argc == 0) || (start && andor))
+    return syntax_error(line, &(token_t){.kind = T_NULL});
+
+  return true;
+}
+
+/* Build a pipeline out of tokens of a well formed `line`, that are delimited by
+ * separators other than `|`. */
+static pipeline_t *pipeline(const char *line, token_t *token, int ntokens) {
+  bool negate = token[0].kind == T_BANG;
+  if (negate) {
+    token++;
+    ntokens--;
+  }
+
+  int nstages = 1;
+  for (int i = 0; i < ntokens; i++)
+    if (token[i].kind == T_PIPE)
+      nstages++;
+
+  pipeline_t *pl =
+    arena_alloc(&cachearena, sizeof(pipeline_t) + sizeof(stage_t) * nstages);
+  pl->negate = negate;
+  pl->nstages = nstages;
+
+  for (int s = 0, i = 0; s < nstages; s++, i++) {
+    stage_t *stage = &pl->stage[s];
+
+    /* Stage has no more arguments than it has tokens. */
+    int end = i;
+    while (end < ntokens && token[end].kind != T_PIPE)
+      end++;
+
+    *stage = (stage_t){
+      .argv = arena_alloc(&cachearena, sizeof(char *) * (end - i + 1)),
+    };
+
+    for (; i < end; i++) {
+      token_t *tok = &token[i];
+      if (tok->kind == T_INPUT)
+        stage->input = word(line, &token[++i]);
+      else if (tok->kind == T_OUTPUT)
+        stage->output = word(line, &token[++i]);
+      else
+        stage->argv[stage->argc++] = word(line, tok);
+    }
+
+    stage->argv[stage->argc] = NULL;
+  }
+
+  return pl;
+}
+
+/* Build a list of pipelines out of tokens of a well formed `line`. */
+static cmdline_t *build(const char *line, token_t *token, int ntokens) {
+  int npipelines = 0;
+
+  for (int i = 0; i < ntokens; i++)
+    if (endpipeline_p(token[i].kind))
+      npipelines++;
+  if (ntokens > 0 && !endpipeline_p(token[ntokens - 1].kind))
+    npipelines++;
+
+  cmdline_t *cl = arena_alloc(&cachearena, sizeof(cmdline_t) +
+                                             sizeof(pipeline_t *) * npipelines);
+  cl->npipelines = npipelines;
+
+  uint8_t when = T_COLON;
+
+  for (int p = 0, i = 0; p < npipelines; p++) {
+    int end = i;
+    while (end < ntokens && !endpipeline_p(token[end].kind))
+      end++;
+
+    uint8_t sep = end < ntokens ? token[end].kind : T_COLON;
+    pipeline_t *pl = pipeline(line, &token[i], end - i);
+    pl->when = when;
+    pl->bg = sep == T_BGJOB;
+    cl->pipeline[p] = pl;
+
+    /* `&` separates pipelines just like `;` does. */
+    when = sep == T_BGJOB ? T_COLON : sep;
+    i = end + 1;
+  }
+
+  return cl;
+}
+
+static void flush(void) {
+  memset(cache, 0, sizeof(cache));
+  ncached = 0;
+  arena_reset(&cachearena);
+}
+
+/* Returns parsed command `line`, or NULL if it's not well formed. Returned
+ * command line is valid until next call. */
+cmdline_t *parse(const char *line) {
+  size_t len = strlen(line);
+  uint32_t hash = jenkins_hash(line, len, HASHINIT);
+  cached_t **bucket = &cache[hash % NBUCKETS];
+
+  for (cached_t *ent = *bucket; ent; ent = ent->next) {
+    if (ent->hash == hash && !strcmp(ent->line, line)) {
+      hits++;
+      return ent->cl;
+    }
+  }
+
+  misses++;
+
+  if (ncached == MAXCACHED)
+    flush();
+
+  int ntokens;
+  token_t *token = tokenize(line, &ntokens, &tokarena);
+  cmdline_t *cl = NULL;
+
+  if (wellformed(line, token, ntokens))
+    cl = build(line, token, ntokens);
+  arena_reset(&tokarena);
+
+  if (cl == NULL)
+    return NULL;
+
+  cached_t *ent = arena_alloc(&cachearena, sizeof(cached_t));
+  ent->hash = hash;
+  ent->line = copystr(line, len);
+  ent->cl = cl;
+  ent->next = *bucket;
+  *bucket = ent;
+  ncached++;
+  return cl;
+}
+
+/* Display usage statistics of parsed command line cache. */
+void printparsecache(void) {
+  printf("parse cache: %u hits, %u misses, %u lines\n", hits, misses, ncached);
+}
@@ -0,0 +1,114 @@
+#include "shell.h"
+
+/* Script is read from a file given on command line or from standard input
+ * that is not a terminal. Regular file is mapped into memory, so getting next
+ * line is just a search for newline, without any system call. Other files
+ * (e.g. pipes) are read in big chunks, hence commands run by the script
+ * cannot read the script themselves. */
+
+#define CHUNK 65536
+
+static int script_fd = -1;    /* descriptor the script is read from */
+static char *data = NULL;     /* mapped file or data read ahead */
+static size_t size = 0;       /* number of bytes in data */
+static size_t cap = 0;        /* capacity of buffer, 0 if file is mapped */
+static size_t pos = 0;        /* position of next line in data */
+static bool seekback = false; /* file offset is shared with commands */
+static char *line = NULL;     /* current line terminated with NUL */
+static size_t linecap = 0;    /* capacity of line buffer */
+
+/* Start reading commands from `fd`, which is closed by `closescript` unless
+ * it's standard input. */
+void openscript(int fd) {
+  struct stat sb;
+  Fstat(fd, &sb);
+
+  script_fd = fd;
+
+  if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    /* Standard input may have been read partially before we were started. */
+    pos = Lseek(fd, 0, SEEK_CUR);
+    size = sb.st_size;
+    data = Mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    Madvise(data, size, MADV_SEQUENTIAL);
+    /* Commands share offset of standard input with the shell. Keep it right
+     * after the current line, just as if the script was read line by line,
+     * and continue from wherever commands left it. */
+    seekback = fd == STDIN_FILENO;
+  } else {
+    cap = CHUNK;
+    data = Malloc(cap);
+  }
+}
+
+/* Read more data into buffer. Returns false at end of file. */
+static bool fill(void) {
+  if (cap == 0)
+    return false;
+
+  memmove(data, data + pos, size - pos);
+  size -= pos;
+  pos = 0;
+
+  if (size == cap) {
+    cap *= 2;
+    data = Realloc(data, cap);
+  }
+
+  size_t n = Read(script_fd, data + size, cap - size);
+  size += n;
+  return n > 0;
+}
+
+/* Returns next line of the script without the newline character, or NULL at
+ * the end of script. Lines that are comments (e.g. `#!/bin/shell`) are skipped.
+ * Returned line is valid until next call. */
+char *readscript(void) {
+  for (;;) {
+    char *nl;
+
+    /* Commands may have consumed some of the script. */
+    if (seekback)
+      pos = min((size_t)Lseek(script_fd, 0, SEEK_CUR), size);
+
+    while ((nl = memchr(data + pos, '\n', size - pos)) == NULL && fill())
+      continue;
+
+    if (pos == size)
+      return NULL;
+
+    size_t len = nl ? (size_t)(nl - (data + pos)) : size - pos;
+
+    if (len + 1 > linecap) {
+      linecap = max(len + 1, (size_t)MAXLINE);
+      line = Realloc(line, linecap);
+    }
+
+    memcpy(line, data + pos, len);
+    line[len] = '\0';
+    pos += nl ? len + 1 : len;
+
+    if (seekback)
+      (void)Lseek(script_fd, pos, SEEK_SET);
+
+    char *s = line;
+    while (isspace(*s))
+      s++;
+    if (*s != '#')
+      return line;
+  }
+}
+
+/* Release resources used to read the script. */
+void closescript(void) {
+  if (cap == 0)
+    Munmap(data, size);
+  else
+    free(data);
+  if (script_fd != STDIN_FILENO)
+    Close(script_fd);
+  free(line);
+  data = line = NULL;
+  size = cap = pos = linecap = 0;
+  script_fd = -1;
+}
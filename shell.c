@@ -7,9 +7,17 @@
 #include "shell.h"
 
 sigset_t sigchld_mask;
+bool interactive;
+
+/* Capacity of pipes that connect commands, 0 for kernel's default. */
+size_t opt_pipesize = 0;
+
+/* Memory for evaluation of a single command line, released by `eval`. */
+static arena_t linearena;
 
 static void sigint_handler(int sig) {
-  /* No-op handler, we just need break read() call with EINTR. */
+  /* Nothing to do, ^C matters only while waiting for input, see `evwait`. A
+   * signal that's ignored would not be received through signalfd. */
   (void)sig;
 }
 
@@ -22,67 +30,95 @@ static void MaybeClose(int *fdp) {
   *fdp = -1;
 }
 
-/* Consume all tokens related to redirection operators.
- * Put opened file descriptors into inputp & output respectively. */
-static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
-  token_t mode = NULL; /* T_INPUT, T_OUTPUT or NULL */
-  int n = 0;           /* number of tokens after redirections are removed */
-
-  for (int i = 0; i < ntokens; i++) {
-    /* TODO: Handle tokens and open files as requested. */
+/* Open files that stage's standard input & output are redirected to.
+ * Put opened file descriptors into inputp & outputp respectively. */
+static void do_redir(stage_t *stage, int *inputp, int *outputp) {
+  /* TODO: Open files as requested. */
 #ifdef STUDENT
+  // redirection takes precedence over a pipe, which end must not leak
+  if (stage->input) {
+    MaybeClose(inputp);
+    *inputp = Open(stage->input, O_RDONLY, 0);
+  }
+  if (stage->output) {
+    MaybeClose(outputp);
+    *outputp = Open(stage->output, O_WRONLY | O_CREAT, S_IWUSR);
+  }
+#endif /* !STUDENT */
+}
 
-    // Start from the end and consume inp/out related tokens UP TO first PIPE
-    // token.
+/* Returns true if command is a builtin that should be run rather than external
+ * command of the same name. Filters run within the shell, so they can't be
+ * stopped like a process, and the shell can't read from terminal it has given
+ * away to a job. Hence an interactive shell, if there's such external command,
+ * uses it for commands reading from the terminal. */
+static bool internal(stage_t *stage, int input) {
+  char **argv = stage->argv;
+  if (!is_builtin(argv))
+    return false;
+  if (!interactive || input >= 0 || stage->input != NULL ||
+      builtin_pipemode(argv) != FILTER)
+    return true;
+  return findcmd(argv[0]) == NULL;
+}
 
-    // go backwards
-    if (i == 0)
-      n = ntokens;
-    int j = ntokens - i - 1;
-    // Consume tokens related to redirection UP TO first appearence of pipe |
-    // operator. AND! starting from the end.
-    if (token[j] == T_PIPE)
-      break;
+/* Run internal command with standard input & output redirected to given files.
+ * Shell's own descriptors are put aside and restored afterwards, without
+ * leaking them to any commands that the builtin might start. */
+static int do_builtin(char **argv, int input, int output) {
+  int fds[2] = {input, output};
+  int saved[2] = {-1, -1};
+
+  /* Output buffered so far belongs to original standard output. */
+  fflush(stdout);
+
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] < 0)
+      continue;
+    /* Standard descriptor might be closed, then it will be closed again. */
+    saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    Dup2(fds[i], i);
+    MaybeClose(&fds[i]);
+  }
 
-    // handle redirections
-    // this accepts command "< file cat" what I call a feature
-    if (token[j] == T_INPUT && j + 1 < ntokens && token[j + 1] != NULL) {
-      int fd = Open(token[j + 1], O_RDONLY, 0);
-      *inputp = fd;
-      token[j] = mode; // mode=NULL
-      token[j + 1] = NULL;
-      if (n == j + 2)
-        n = j;
-    }
-    if (token[j] == T_OUTPUT && j + 1 < ntokens && token[j + 1] != NULL) {
-      int fd = Open(token[j + 1], O_WRONLY | O_CREAT, S_IWUSR);
-      *outputp = fd;
-      token[j] = NULL;
-      token[j + 1] = NULL;
-      if (n == j + 2)
-        n = j;
-    }
-    // leaks opened file descriptors if multiple redirects
+  int exitcode = builtin_command(argv);
 
-#endif /* !STUDENT */
+  for (int i = 0; i < 2; i++) {
+    if (saved[i] >= 0) {
+      Dup2(saved[i], i);
+      MaybeClose(&saved[i]);
+    } else if (i == 0 ? input >= 0 : output >= 0) {
+      (void)close(i);
+    }
   }
 
-  token[n] = NULL;
-  return n;
+  return exitcode;
 }
 
 /* Execute internal command within shell's process or execute external command
  * in a subprocess. External command can be run in the background. */
-static int do_job(token_t *token, int ntokens, bool bg) {
+static int do_job(stage_t *stage, bool bg) {
+  char **argv = stage->argv;
   int input = -1, output = -1;
   int exitcode = 0;
 
-  ntokens = do_redir(token, ntokens, &input, &output);
+  do_redir(stage, &input, &output);
 
-  if (!bg) {
-    if ((exitcode = builtin_command(token)) >= 0)
-      return exitcode;
+  if (!bg && internal(stage, input))
+    return do_builtin(argv, input, output);
+
+#ifdef STUDENT
+  // search PATH in the parent, so it is done once and a missing command does
+  // not cost a process that would only fail in execve
+  cmdent_t *cmd = findcmd(argv[0]);
+  if (cmd == NULL) {
+    exitcode = errno == ENOENT ? 127 : 126;
+    msg("%s: %s\n", argv[0], strerror(errno));
+    MaybeClose(&input);
+    MaybeClose(&output);
+    return exitcode;
   }
+#endif /* !STUDENT */
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
@@ -90,9 +126,13 @@ static int do_job(token_t *token, int ntokens, bool bg) {
   /* TODO: Start a subprocess, create a job and monitor it. */
 #ifdef STUDENT
   int pid;
-  if ((pid = Fork()) == 0) {
-    // in child
-    Setpgid(0, 0);
+  if (opt_spawn) {
+    // child has already set up its process group and performed execve
+    pid = spawn(0, input, output, cmd, argv, bg);
+  } else if ((pid = Fork()) == 0) {
+    // in child, without job control it stays in shell's process group
+    if (interactive)
+      Setpgid(0, 0);
     if (!bg)
       setfgpgrp(getpgrp());
 
@@ -113,26 +153,27 @@ static int do_job(token_t *token, int ntokens, bool bg) {
     Signal(SIGTTOU, SIG_DFL);
 
     // execve, fg builtin command above
-    external_command(token);
+    external_command(cmd, argv);
 
   } else {
-    // in parent
-
     // ignore EACCES error - children already performed execve
-    setpgid(pid, pid);
+    if (interactive)
+      setpgid(pid, pid);
+  }
 
-    MaybeClose(&input);
-    MaybeClose(&output);
+  // in parent
+  MaybeClose(&input);
+  MaybeClose(&output);
 
-    int j = addjob(pid, bg);
-    addproc(j, pid, token);
-    if (!bg) {
-      setfgpgrp(pid);
-      monitorjob(&mask);
-    } else {
-      setfgpgrp(getpgrp());
+  int j = addjob(pid, bg);
+  addproc(j, pid, argv, false);
+  if (!bg) {
+    setfgpgrp(pid);
+    exitcode = monitorjob(&mask);
+  } else {
+    setfgpgrp(getpgrp());
+    if (interactive)
       dprintf(STDIN_FILENO, "[%d] running '%s'\n", j, jobcmd(j));
-    }
   }
 
 #endif /* !STUDENT */
@@ -142,21 +183,41 @@ static int do_job(token_t *token, int ntokens, bool bg) {
 }
 
 /* Start internal or external command in a subprocess that belongs to pipeline.
- * All subprocesses in pipeline must belong to the same process group. */
+ * All subprocesses in pipeline must belong to the same process group.
+ * Returns 0 if external command was not found and no process was started. */
 static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
-                      token_t *token, int ntokens, bool bg) {
-  ntokens = do_redir(token, ntokens, &input, &output);
+                      stage_t *stage, bool bg) {
+  char **argv = stage->argv;
 
-  if (ntokens == 0)
-    app_error("ERROR: Command line is not well formed!");
+  do_redir(stage, &input, &output);
 
   /* TODO: Start a subprocess and make sure it's moved to a process group. */
+#ifdef STUDENT
+  cmdent_t *cmd = NULL;
+  if (!internal(stage, input) && (cmd = findcmd(argv[0])) == NULL) {
+    msg("%s: %s\n", argv[0], strerror(errno));
+    MaybeClose(&input);
+    MaybeClose(&output);
+    return 0;
+  }
+
+  // builtins run in a copy of the shell, so they cannot be spawned
+  if (opt_spawn && cmd) {
+    pid_t pid = spawn(pgid, input, output, cmd, argv, bg);
+    if (!bg)
+      setfgpgrp(pgid ? pgid : pid);
+    MaybeClose(&input);
+    MaybeClose(&output);
+    return pid;
+  }
+#endif /* !STUDENT */
   pid_t pid = Fork();
 #ifdef STUDENT
 
   if (pid == 0) {
     // child
-    setpgid(0, pgid);
+    if (interactive)
+      setpgid(0, pgid);
     if (!bg)
       setfgpgrp(getpgrp());
     // set stdin/stdout
@@ -175,13 +236,15 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
     Signal(SIGTTIN, SIG_DFL);
     Signal(SIGTTOU, SIG_DFL);
 
-    if (builtin_command(token) < 0) {
-      external_command(token);
-    }
+    // builtin must not return to the copy of the shell it runs in
+    if (cmd == NULL)
+      exit(builtin_command(argv));
+    external_command(cmd, argv);
 
   } else {
     // ignore EACCES - children already performed execve
-    setpgid(pid, pgid);
+    if (interactive)
+      setpgid(pid, pgid);
     if (!bg) {
       setfgpgrp(pgid ? pgid : pid);
     } else {
@@ -197,25 +260,125 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
   return pid;
 }
 
-static void mkpipe(int *readp, int *writep) {
+/* Start command as a background job that reads from /dev/null, on behalf of
+ * a builtin that runs many commands at once. The job is not announced, the
+ * builtin collects it with `jobstate`. Returns -1 if command was not found.
+ * Must be called with SIGCHLD blocked. */
+int startjob(char **argv) {
+  stage_t stage = {.argv = argv};
+  while (argv[stage.argc])
+    stage.argc++;
+
+  int input = Open("/dev/null", O_RDONLY | O_CLOEXEC, 0);
+  pid_t pid = do_stage(0, NULL, input, -1, &stage, true);
+  if (pid == 0)
+    return -1;
+
+  int j = addjob(pid, BG);
+  addproc(j, pid, argv, false);
+  return j;
+}
+
+/* Seconds elapsed from `start` taken from CLOCK_MONOTONIC, which builtins that
+ * start jobs use to time them. */
+double since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/* Linux specific, glibc hides it unless _GNU_SOURCE is defined. */
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
+/* Returns the largest capacity an unprivileged user can give to a pipe. */
+static size_t maxpipesize(void) {
+  static size_t maxsize = 0;
+
+  if (maxsize == 0) {
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f == NULL || fscanf(f, "%zu", &maxsize) != 1)
+      maxsize = 1 << 20; /* kernel's default */
+    if (f != NULL)
+      fclose(f);
+  }
+
+  return maxsize;
+}
+
+/* Pipe is created with both ends closed on exec in one go. If `size` is given,
+ * its capacity is grown, so that writer fills it up and reader drains it less
+ * often, which means fewer context switches. Kernel may refuse to do it (e.g.
+ * user has too many big pipes), but the pipe works nonetheless. */
+static void mkpipe(int *readp, int *writep, size_t size) {
   int fds[2];
-  Pipe(fds);
-  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
-  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  Pipe2(fds, O_CLOEXEC);
+  if (size > 0)
+    (void)fcntl(fds[1], F_SETPIPE_SZ, (int)min(size, maxpipesize()));
   *readp = fds[0];
   *writep = fds[1];
 }
 
-/* Pipeline execution creates a multiprocess job. Both internal and external
- * commands are executed in subprocesses. */
-static int do_pipeline(token_t *token, int ntokens, bool bg) {
+/* Builtin that is a part of a foreground pipeline and runs as a coroutine. */
+typedef struct costage {
+  char **argv;
+  int input, output; /* pipe ends or redirections, -1 for shell's own */
+  int exitcode;
+} costage_t;
+
+/* Most builtins print with stdio, so their output is gathered in memory and
+ * then written out without blocking other stages that run within the shell.
+ * Filters may give way while they read, hence each one has its own stream. */
+static void run_costage(void *arg) {
+  costage_t *cs = arg;
+  char *buf = NULL;
+  size_t len = 0;
+
+  FILE *out = open_memstream(&buf, &len);
+  costdout(out);
+  cs->exitcode = builtin_command(cs->argv);
+  costdout(NULL);
+  fclose(out);
+
+  /* Reader may be gone, just as with a builtin run in a subprocess. */
+  (void)cowrite(cofd(STDOUT_FILENO), buf, len);
+  free(buf);
+
+  MaybeClose(&cs->input);
+  MaybeClose(&cs->output);
+}
+
+/* Prepare builtin to run within the shell once all subprocesses of pipeline
+ * are started, which is much cheaper than forking a copy of the shell. */
+static costage_t *do_costage(int input, int output, stage_t *stage) {
+  do_redir(stage, &input, &output);
+
+  /* Only the shell uses those descriptors, others have their own pipe ends. */
+  if (input >= 0)
+    fcntl(input, F_SETFL, O_NONBLOCK);
+  if (output >= 0)
+    fcntl(output, F_SETFL, O_NONBLOCK);
+
+  costage_t *cs = arena_alloc(&linearena, sizeof(costage_t));
+  *cs = (costage_t){.argv = stage->argv, .input = input, .output = output};
+  cospawn(run_costage, cs, input, output);
+  return cs;
+}
+
+/* Pipeline execution creates a multiprocess job. External commands are
+ * executed in subprocesses. So are builtins, unless the pipeline runs in the
+ * foreground and they don't change the state of the shell. */
+static int do_pipeline(pipeline_t *pl, size_t pipesize) {
   pid_t pid, pgid = 0;
   int job = -1;
   int exitcode = 0;
+  bool bg = pl->bg;
+  costage_t *cs = NULL;
 
   int input = -1, output = -1, next_input = -1;
 
-  mkpipe(&next_input, &output);
+  mkpipe(&next_input, &output, pipesize);
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
@@ -223,192 +386,432 @@ static int do_pipeline(token_t *token, int ntokens, bool bg) {
   /* TODO: Start pipeline subprocesses, create a job and monitor it.
    * Remember to close unused pipe ends! */
 #ifdef STUDENT
+  // pids are remembered to add processes to the job once it's created
+  pid_t *pids = arena_alloc(&linearena, sizeof(pid_t) * pl->nstages);
+  int last = pl->nstages - 1;
+
+  for (int i = 0; i <= last; i++) {
+    stage_t *stage = &pl->stage[i];
+    pipemode_t mode = SUBSHELL;
+    if (!bg && internal(stage, input))
+      mode = builtin_pipemode(stage->argv);
+    // builtin running as a coroutine has no process, so it's marked with -1
+    if (mode != SUBSHELL) {
+      cs = do_costage(input, output, stage);
+      pid = -1;
+    } else {
+      cs = NULL;
+      pid = do_stage(pgid, &mask, input, output, stage, bg);
+    }
+    // stage that was not found does not lead the process group
+    if (pgid == 0 && pid > 0)
+      pgid = pid;
+    pids[i] = pid;
+
+    // connect next stage to the one that has just been started
+    input = next_input;
+    next_input = output = -1;
+    if (i + 1 < last)
+      mkpipe(&next_input, &output, pipesize);
+  }
 
-  // Here I traverse the token list starting from the end and creating
-  // processes. This turned out to be a bad idea as the job command and proc
-  // list was created backwards. I decided on a hack: store pids in a list and
-  // run addproc in a seperate loop after the main loop.
-
-  int next_output;
-  int *pid_list = Malloc(sizeof(int));
-  int pid_n = 0;
-
-  // start with some process (the last in pipeline)
-  int i = ntokens - 1;
-  // traverse up to previous T_PIPE token.
-  for (; i > 0 && token[i] != T_PIPE; i--) {
-    ;
+  // none of the commands was found or all are coroutines
+  if (pgid == 0) {
+    corun(-1);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    return cs ? cs->exitcode : 127;
   }
-  pgid = do_stage(0, &mask, next_input, -1, &token[i + 1], ntokens - i - 1, bg);
-  next_output = output;
+
   job = addjob(pgid, bg);
-  token[i] = NULL;
+  for (int i = 0; i <= last; i++)
+    if (pids[i] >= 0)
+      addproc(job, pids[i], pl->stage[i].argv,
+              i < last && pl->stage[i].output == NULL);
 
-  // save pid to later call addproc
-  pid_list[pid_n] = pgid;
-  pid_n += 1;
-  pid_list = Realloc(pid_list, sizeof(int) * (pid_n + 1));
+  if (!bg) {
+    setfgpgrp(pgid);
+    // coroutines exchange data with subprocesses, so they must finish first
+    corun(job);
+    exitcode = monitorjob(&mask);
+    if (cs != NULL)
+      exitcode = cs->exitcode;
+  } else {
+    setfgpgrp(getpgrp());
+    if (interactive)
+      dprintf(STDIN_FILENO, "[%d] running '%s'\n", job, jobcmd(job));
+  }
 
-  // continue with the rest of processes
-  while (1) {
-    int j = i;
+#endif /* !STUDENT */
 
-    // traverse up to previous T_PIPE token or begining.
-    for (; i > 0 && token[i] != T_PIPE; i--) {
-      ;
-    }
-    if (token[i] == T_PIPE) {
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return exitcode;
+}
 
-      mkpipe(&input, &output);
-      pid =
-        do_stage(pgid, &mask, input, next_output, &token[i + 1], j - i - 1, bg);
-      next_output = output;
+/* Replace the shell with a simple external command instead of running it in a
+ * subprocess and waiting for it. Returns if the pipeline is anything else, or
+ * the command cannot be found, to let `run` handle it. */
+static void do_exec(pipeline_t *pl) {
+  if (pl->nstages != 1 || pl->bg || pl->negate)
+    return;
 
-      // save pid to later call addproc
-      pid_list[pid_n] = pid;
-      pid_n += 1;
-      pid_list = Realloc(pid_list, sizeof(int) * (pid_n + 1));
+  stage_t *stage = &pl->stage[0];
+  if (is_builtin(stage->argv))
+    return;
 
-      // mark seperation
-      token[i] = NULL;
+  cmdent_t *cmd = findcmd(stage->argv[0]);
+  if (cmd == NULL)
+    return;
 
-    } else { // i = 0
-      pid = do_stage(pgid, &mask, -1, next_output, token, j, bg);
+  int input = -1, output = -1;
+  do_redir(stage, &input, &output);
+  if (input >= 0)
+    Dup2(input, 0);
+  if (output >= 0)
+    Dup2(output, 1);
+  MaybeClose(&input);
+  MaybeClose(&output);
+
+  replace_shell(cmd, stage->argv);
+}
 
-      // save pid to later call addproc
-      pid_list[pid_n] = pid;
-      pid_n += 1;
-      pid_list = Realloc(pid_list, sizeof(int) * (pid_n + 1));
+/* Pipeline that starts with `pipesize size` has pipes of that capacity. Such
+ * prefix is stripped off a copy of the pipeline, since parsed command line
+ * must not be modified. Others have pipes of capacity set for the shell. */
+static pipeline_t *strip_pipesize(pipeline_t *pl, size_t *sizep) {
+  *sizep = opt_pipesize;
+
+  stage_t first = pl->stage[0];
+  int n, skip = 0;
+  while ((n = pipesize_prefix(first.argv + skip, sizep)) > 0)
+    skip += n;
+  if (skip == 0)
+    return pl;
+
+  size_t size = sizeof(pipeline_t) + sizeof(stage_t) * pl->nstages;
+  pipeline_t *copy = arena_alloc(&linearena, size);
+  memcpy(copy, pl, size);
+  copy->stage[0].argv += skip;
+  copy->stage[0].argc -= skip;
+  return copy;
+}
 
-      break;
-    }
-  }
+/* Execute a single pipeline, possibly in place of the shell if `tail` is set.
+ * Returns its exit status, not inverted by `!` yet. */
+static int run_pipeline(pipeline_t *pl, bool tail) {
+  size_t pipesize;
+  bool catstatus;
+  int exitcode;
 
-  // I wanted to iterate from last process in pipe to first.
-  // Didnt realize this means addproc is called in this order and so command is
-  // created backwards. Prefer this quick hack to fix command (and exit status)
-  // rather than rewrite this and do_redir.
-  token_t *start = token;
-  for (int l = 0; l < pid_n; l++) {
-    addproc(job, pid_list[pid_n - l - 1], start);
-
-    // loop to next cmd
-    if (l + 1 < pid_n) {
-      for (; *start; start++) {
-      }
-      start++;
-    }
-  }
+  pl = strip_pipesize(pl, &pipesize);
+  pl = optimize(pl, &linearena, &catstatus);
 
-  free(pid_list);
+  if (tail && !catstatus)
+    do_exec(pl);
 
-  if (!bg) {
-    setfgpgrp(pgid);
-    monitorjob(&mask);
+  if (pl->nstages > 1) {
+    exitcode = do_pipeline(pl, pipesize);
   } else {
-    setfgpgrp(getpgrp());
-    dprintf(STDIN_FILENO, "[%d] running '%s'\n", job, jobcmd(job));
+    exitcode = do_job(&pl->stage[0], pl->bg);
   }
+  arena_reset(&linearena);
 
-#endif /* !STUDENT */
+  /* Removed cat would have succeeded, unless it was killed with the rest. */
+  if (catstatus && exitcode < 128)
+    exitcode = 0;
 
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return exitcode;
 }
 
-static bool is_pipeline(token_t *token, int ntokens) {
-  for (int i = 0; i < ntokens; i++)
-    if (token[i] == T_PIPE)
-      return true;
-  return false;
+/* Start background jobs waiting in run queue for as long as there's room for
+ * them. That happens only while the shell is not waiting for a foreground job,
+ * since the terminal belongs to it. If `newline` is set, line being typed is
+ * broken before jobs are announced. Returns number of jobs started. */
+static int start_queued(bool newline) {
+  pipeline_t *pl;
+  int n = 0;
+
+  while ((pl = admitjob()) != NULL) {
+    if (newline && n == 0 && interactive)
+      msg("\n");
+    (void)run_pipeline(pl, false);
+    n++;
+  }
+
+  return n;
 }
 
-static void eval(char *cmdline) {
-  bool bg = false;
-  int ntokens;
-  token_t *token = tokenize(cmdline, &ntokens);
+/* Shell that is about to exit leaves its background jobs running, but those
+ * in run queue have to be started first. */
+static void flush_queued(void) {
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  while (start_queued(false), queuedjobs() > 0)
+    Sigsuspend(&mask);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
 
-  if (ntokens > 0 && token[ntokens - 1] == T_BGJOB) {
-    token[--ntokens] = NULL;
-    bg = true;
-  }
+/* Execute parsed command line. Pipelines that follow `&&` or `||` are run
+ * depending on exit status of the previous one. If `tail` is set nothing is
+ * left to do afterwards, so the last pipeline is executed in place of the
+ * shell if possible. Background pipeline over the limit of running jobs is
+ * put in run queue instead. Returns exit status of the line, 2 if it's
+ * malformed. */
+static int run(cmdline_t *cl, bool tail) {
+  if (cl == NULL)
+    return 2;
 
-  if (ntokens > 0) {
-    if (is_pipeline(token, ntokens)) {
-      do_pipeline(token, ntokens, bg);
+  int exitcode = 0;
+
+  for (int i = 0; i < cl->npipelines; i++) {
+    pipeline_t *pl = cl->pipeline[i];
+
+    if ((pl->when == T_AND && exitcode != 0) ||
+        (pl->when == T_OR && exitcode == 0))
+      continue;
+
+    /* Jobs that have waited for long enough go before this one. */
+    (void)start_queued(false);
+
+    int j;
+    if (pl->bg && (j = queuejob(pl)) >= 0) {
+      if (interactive)
+        dprintf(STDIN_FILENO, "[%d] queued '%s'\n", j, jobcmd(j));
+      exitcode = 0;
     } else {
-      do_job(token, ntokens, bg);
+      exitcode = run_pipeline(pl, tail && i == cl->npipelines - 1);
     }
+
+    if (pl->negate)
+      exitcode = !exitcode;
+
+    /* Interrupted foreground job stops the whole line, as user expects. */
+    if (interactive && exitcode == 128 + SIGINT)
+      break;
   }
 
-  free(token);
+  return exitcode;
 }
 
-#ifndef READLINE
-static char *readline(const char *prompt) {
-  static char line[MAXLINE]; /* `readline` is clearly not reentrant! */
+static int eval(const char *cmdline) {
+  return run(parse(cmdline), false);
+}
 
-  write(STDOUT_FILENO, prompt, strlen(prompt));
+/* Execute command string given with `-c` line by line. Nothing is left to do
+ * after the last line, so it's executed in place of the shell if possible. */
+static int run_string(char *cmdstr) {
+  int exitcode = 0;
 
-  line[0] = '\0';
+  for (char *line = cmdstr, *next; line != NULL; line = next) {
+    if ((next = strchr(line, '\n')) != NULL)
+      *next++ = '\0';
+    if (next != NULL && *next == '\0')
+      next = NULL;
 
-  ssize_t nread = read(STDIN_FILENO, line, MAXLINE);
-  if (nread < 0) {
-    if (errno != EINTR)
-      unix_error("Read error");
-    msg("\n");
-  } else if (nread == 0) {
-    return NULL; /* EOF */
-  } else {
-    if (line[nread - 1] == '\n')
-      line[nread - 1] = '\0';
+    if (strlen(line))
+      exitcode = run(parse(line), next == NULL && queuedjobs() == 0);
+    reapjobs();
   }
 
-  return strdup(line);
+  flush_queued();
+  return exitcode;
+}
+
+/* Seconds user may be idle before the shell quits, 0 if there's no limit. */
+static unsigned idletimeout = 0;
+
+#ifdef READLINE
+static char *gotline; /* line read by `readcommand` */
+static bool linedone; /* set once whole line (or EOF) is read */
+
+static void readline_done(char *line) {
+  rl_callback_handler_remove();
+  gotline = line;
+  linedone = true;
+}
+#endif
+
+/* Redisplay prompt and line being typed, which is kept by readline, or by the
+ * terminal in canonical mode, after something else has been printed. */
+static void reprompt(const char *prompt) {
+#ifdef READLINE
+  rl_on_new_line();
+  rl_redisplay();
+#else
+  write(STDOUT_FILENO, prompt, strlen(prompt));
+#endif
 }
+
+/* Reads a command line, while taking care of whatever happens in the meantime:
+ * background jobs are reported as soon as they finish, ^C discards the line
+ * being typed and the shell quits when the user's been idle for too long.
+ * Returns NULL on end of input. */
+static char *readcommand(const char *prompt) {
+#ifdef READLINE
+  linedone = false;
+  rl_callback_handler_install(prompt, readline_done);
+#else
+  static char line[MAXLINE]; /* not reentrant, just like `readline` */
+  write(STDOUT_FILENO, prompt, strlen(prompt));
 #endif
 
+  evbegin(STDIN_FILENO, idletimeout);
+
+  /* A job could have finished before signals were blocked by `evbegin`. One
+   * that was killed does not count as finished, but makes room for another. */
+  char *result = NULL;
+  int events = jobsfinished() || queuedready() ? EV_CHILD : evwait();
+
+  for (;; events = evwait()) {
+    if (events & EV_CHILD) {
+      childevents();
+      bool finished = jobsfinished();
+      if (finished) {
+        msg("\n");
+        watchjobs(FINISHED, false);
+        fflush(stdout);
+      }
+      /* Jobs from run queue take slots of those that have just finished. */
+      if (start_queued(!finished) > 0 || finished)
+        reprompt(prompt);
+    }
+
+    if (events & EV_INTR) {
+#ifdef READLINE
+      rl_replace_line("", 0);
+#endif
+      msg("\n");
+      reprompt(prompt);
+      continue;
+    }
+
+    if (events & EV_TIMEOUT) {
+#ifdef READLINE
+      rl_callback_handler_remove();
+#endif
+      msg("\ntimed out waiting for input: auto-logout");
+      break;
+    }
+
+    if (events & EV_INPUT) {
+#ifdef READLINE
+      rl_callback_read_char();
+      if (linedone) {
+        result = gotline;
+        break;
+      }
+#else
+      ssize_t nread = read(STDIN_FILENO, line, MAXLINE - 1);
+      if (nread < 0 && errno != EINTR && errno != EAGAIN)
+        unix_error("Read error");
+      if (nread == 0)
+        break; /* EOF */
+      if (nread > 0) {
+        line[nread] = '\0';
+        if (line[nread - 1] == '\n')
+          line[nread - 1] = '\0';
+        result = line;
+        break;
+      }
+#endif
+    }
+  }
+
+  evend();
+  return result;
+}
+
 int main(int argc, char *argv[]) {
-  /* `stdin` should be attached to terminal running in canonical mode */
-  if (!isatty(STDIN_FILENO))
-    app_error("ERROR: Shell can run only in interactive mode!");
+  int script = -1;
+  char *cmdstr = NULL;
+  int exitcode = 0;
+
+  /* Commands are read from terminal running in canonical mode, unless the
+   * shell runs a script given as an argument or on standard input, or a
+   * command string given with `-c`. */
+  if (argc > 1 && !strcmp(argv[1], "-c")) {
+    if ((cmdstr = argv[2]) == NULL) {
+      msg("%s: -c: option requires an argument\n", argv[0]);
+      return 2;
+    }
+  } else if (argc > 1) {
+    if ((script = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0) {
+      msg("%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+      return 127;
+    }
+  } else if (!isatty(STDIN_FILENO)) {
+    script = STDIN_FILENO;
+  }
+
+  interactive = script < 0 && cmdstr == NULL;
 
 #ifdef READLINE
-  rl_initialize();
+  if (interactive)
+    rl_initialize();
 #endif
 
   sigemptyset(&sigchld_mask);
   sigaddset(&sigchld_mask, SIGCHLD);
 
-  if (getsid(0) != getpgid(0))
+  if (interactive && getsid(0) != getpgid(0))
     Setpgid(0, 0);
 
   initjobs();
 
-  struct sigaction act = {
-    .sa_handler = sigint_handler,
-    .sa_flags = 0, /* without SA_RESTART read() will return EINTR */
-  };
-  Sigaction(SIGINT, &act, NULL);
-
-  Signal(SIGTSTP, SIG_IGN);
-  Signal(SIGTTIN, SIG_IGN);
-  Signal(SIGTTOU, SIG_IGN);
+  /* Code injected with LD_PRELOAD (e.g. a tracer) may wrap fork, execve or
+   * any other libc function that vfork'ed child calls. Play it safe, tests
+   * that trace the vfork path turn it on with `set -o spawn`. */
+  if (getenv("LD_PRELOAD"))
+    opt_spawn = false;
+
+  if (interactive) {
+    struct sigaction act = {
+      .sa_handler = sigint_handler,
+      .sa_flags = SA_RESTART,
+    };
+    Sigaction(SIGINT, &act, NULL);
+
+    char *tmout = getenv("TMOUT");
+    if (tmout != NULL)
+      idletimeout = atoi(tmout);
+
+    Signal(SIGTSTP, SIG_IGN);
+    Signal(SIGTTIN, SIG_IGN);
+    Signal(SIGTTOU, SIG_IGN);
+  } else if (cmdstr != NULL) {
+    return run_string(cmdstr);
+  } else {
+    openscript(script);
+  }
 
   while (true) {
-    char *line = readline("# ");
+    char *line = interactive ? readcommand("# ") : readscript();
 
     if (line == NULL)
       break;
 
     if (strlen(line)) {
 #ifdef READLINE
-      add_history(line);
+      if (interactive)
+        add_history(line);
 #endif
-      eval(line);
+      exitcode = eval(line);
     }
-    free(line);
-    watchjobs(FINISHED);
+#ifdef READLINE
+    if (interactive)
+      free(line);
+#endif
+    if (interactive)
+      watchjobs(FINISHED, false);
+    else
+      reapjobs();
+    (void)start_queued(false);
+  }
+
+  /* Script leaves its background jobs running, just like other shells do. */
+  if (!interactive) {
+    closescript();
+    flush_queued();
+    return exitcode;
   }
 
   msg("\n");
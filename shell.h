@@ -11,23 +11,66 @@
 #define debug(...)
 #endif
 
-typedef char *token_t;
-
-#define T_NULL ((token_t)0)
-#define T_AND ((token_t)1)
-#define T_OR ((token_t)2)
-#define T_PIPE ((token_t)3)
-#define T_BGJOB ((token_t)4)
-#define T_COLON ((token_t)5)
-#define T_OUTPUT ((token_t)6)
-#define T_INPUT ((token_t)7)
-#define T_APPEND ((token_t)8)
-#define T_BANG ((token_t)9)
-#define separator_p(t) ((t) <= T_COLON)
-#define string_p(t) ((t) > T_BANG)
+/* Token kinds. Everything that is not an operator is a word. */
+enum {
+  T_NULL,   /* end of tokens */
+  T_AND,    /* && */
+  T_OR,     /* || */
+  T_PIPE,   /* | */
+  T_BGJOB,  /* & */
+  T_COLON,  /* ; */
+  T_OUTPUT, /* > */
+  T_INPUT,  /* < */
+  T_APPEND, /* >> */
+  T_BANG,   /* ! */
+  T_WORD,
+};
+
+#define separator_p(kind) ((kind) <= T_COLON)
+
+/* Token refers to characters of the line it was read from. */
+typedef struct token {
+  uint8_t kind;    /* one of T_* values */
+  uint32_t offset; /* position of the first character in the line */
+  uint32_t length; /* number of characters */
+} token_t;
 
 void strapp(char **dstp, const char *src);
-token_t *tokenize(char *s, int *tokc_p);
+token_t *tokenize(const char *s, int *tokc_p, arena_t *arena);
+bool uselexer(const char *isa);
+
+/* Command that is a part of pipeline, with its redirections. */
+typedef struct stage {
+  int argc;
+  char **argv;  /* arguments terminated with NULL */
+  char *input;  /* file redirected to standard input or NULL */
+  char *output; /* file redirected to standard output or NULL */
+} stage_t;
+
+/* Commands connected with pipes, optionally preceded by `!`. */
+typedef struct pipeline {
+  uint8_t when;    /* T_COLON - always run, T_AND / T_OR - run only if
+                    * previous pipeline succeeded / failed */
+  bool bg;         /* run in the background */
+  bool negate;     /* exit status is logically inverted */
+  int nstages;     /* at least one */
+  stage_t stage[]; /* commands connected with pipes */
+} pipeline_t;
+
+/* Parsed command line. It's never modified, so it can be run many times. */
+typedef struct cmdline {
+  int npipelines;         /* zero for an empty line */
+  pipeline_t *pipeline[]; /* separated with `;`, `&`, `&&` or `||` */
+} cmdline_t;
+
+cmdline_t *parse(const char *line);
+void printparsecache(void);
+
+pipeline_t *optimize(pipeline_t *pl, arena_t *arena, bool *catp);
+
+void openscript(int fd);
+char *readscript(void);
+void closescript(void);
 
 /* Do not change those values or code will break! */
 enum {
@@ -41,23 +84,121 @@ enum {
   FINISHED = 0, /* only jobs that have finished */
   RUNNING = 1,  /* only jobs that are still running */
   STOPPED = 2,  /* jobs that have been suspended by SIGTSTP / SIGSTOP */
+  QUEUED = 3,   /* background jobs waiting in run queue, see `bglimit` */
 };
 
 void initjobs(void);
 void shutdownjobs(void);
 
 int addjob(pid_t pgid, int bg);
-void addproc(int job, pid_t pid, char **argv);
+void addproc(int job, pid_t pid, char **argv, bool piped);
 bool killjob(int job);
-void watchjobs(int state);
+void watchjobs(int state, bool procs);
+bool cutoffjob(int job, int sig);
+void printcutoffs(void);
+bool jobsfinished(void);
+void reapjobs(void);
 char *jobcmd(int job);
 bool resumejob(int job, int bg, sigset_t *mask);
 int monitorjob(sigset_t *mask);
+int jobstate(int job, int *statusp);
+bool jobstopped(int job);
+int startjob(char **argv);
+double since(const struct timespec *start);
+
+void childevents(void);
 
 void setfgpgrp(pid_t pgid);
+int ttyfd(void);
+
+void cospawn(void (*func)(void *), void *arg, int input, int output);
+int cofd(int fd);
+void costdout(FILE *out);
+bool cowait(int fd, short events);
+ssize_t coread(int fd, void *buf, size_t count);
+ssize_t cowrite(int fd, const void *buf, size_t count);
+void corun(int job);
+
+/* Events interactive shell waits for, see events.c */
+enum {
+  EV_INPUT = 1,   /* terminal has input to read */
+  EV_CHILD = 2,   /* child has changed its state */
+  EV_INTR = 4,    /* user has pressed ^C */
+  EV_TIMEOUT = 8, /* user has been idle for too long */
+};
 
+void evbegin(int input, unsigned timeout);
+int evwait(void);
+void evready(struct pollfd *fds, int nfds);
+void evend(void);
+
+/* External command located in PATH, see hash.c */
+typedef struct cmdent cmdent_t;
+
+/* How builtin runs when it's a part of a foreground pipeline. */
+typedef enum {
+  SUBSHELL, /* in a copy of the shell, since it changes shell's state */
+  CAPTURE,  /* within the shell, what it prints with stdio is captured */
+  FILTER,   /* like CAPTURE, but it also reads standard input, see `cofd` */
+} pipemode_t;
+
+bool is_builtin(char **argv);
+pipemode_t builtin_pipemode(char **argv);
 int builtin_command(char **argv);
-noreturn void external_command(char **argv);
+noreturn void external_command(cmdent_t *cmd, char **argv);
+noreturn void replace_shell(cmdent_t *cmd, char **argv);
+
+/* Builtins that move data, see move.c */
+bool cat_accepts(char **argv);
+int do_cat(char **argv);
+bool tee_accepts(char **argv);
+int do_tee(char **argv);
+
+/* Builtins that count text, see count.c */
+bool usecounter(const char *isa);
+bool wc_accepts(char **argv);
+int do_wc(char **argv);
+bool grep_accepts(char **argv);
+int do_grep(char **argv);
+
+/* Builtin that runs commands for lines of input, see parallel.c */
+int do_parallel(char **argv);
+
+/* Builtin that runs steps of a dependency graph, see dag.c */
+int do_dag(char **argv);
+
+pid_t spawn(pid_t pgid, int input, int output, cmdent_t *cmd, char **argv,
+            bool bg);
+
+cmdent_t *findcmd(const char *name);
+void execcmd(cmdent_t *cmd, char **argv);
+void printcmds(void);
+void flushcmds(void);
+
+/* Shell options, see `set` builtin. */
+extern bool opt_spawn;
+extern bool opt_pathfd;
+extern bool opt_rewrite;
+extern bool opt_rewritelog;
+
+/* Capacity of pipes, see `pipesize` builtin. */
+extern size_t opt_pipesize;
+int pipesize_prefix(char **argv, size_t *sizep);
+
+/* Signal for upstream processes of new jobs, see `cutoff` builtin. */
+extern int opt_cutoff;
+
+/* Admission of background jobs, see `bglimit` builtin. */
+extern int opt_bglimit;
+extern bool opt_bgpressure;
+int queuejob(pipeline_t *pl);
+pipeline_t *admitjob(void);
+int queuedjobs(void);
+bool queuedready(void);
+void printbglimit(void);
+
+/* Set if commands are read from terminal. Job control is enabled only then. */
+extern bool interactive;
 
 /* Used by Sigprocmask to enter critical section protecting against SIGCHLD. */
 extern sigset_t sigchld_mask;
@@ -0,0 +1,77 @@
+#include "shell.h"
+
+/* If set external commands are started with vfork(2) instead of fork(2). */
+bool opt_spawn = true;
+
+/* The only piece of memory written by vfork'ed child for its parent. */
+static volatile int spawn_errno;
+
+/* Signals that shell catches or ignores. Their disposition must be reset
+ * before child unblocks signals, otherwise a handler could run on the stack
+ * borrowed from parent or a signal would be ignored by the new program. */
+static const int spawn_sigdfl[] = {SIGINT, SIGCHLD, SIGTSTP, SIGTTIN, SIGTTOU};
+
+/* Runs in the child between vfork and execve. Only raw system calls are
+ * allowed here, since wrappers exit on failure and run atexit handlers of the
+ * parent. Does exactly what the child branch of `do_job` does. */
+static noreturn void spawn_child(pid_t pgid, int input, int output,
+                                 cmdent_t *cmd, char **argv, bool bg) {
+  if (interactive) {
+    setpgid(0, pgid);
+    if (!bg)
+      tcsetpgrp(ttyfd(), getpgrp());
+  }
+
+  if (input >= 0) {
+    dup2(input, STDIN_FILENO);
+    close(input);
+  }
+  if (output >= 0) {
+    dup2(output, STDOUT_FILENO);
+    close(output);
+  }
+
+  struct sigaction act = {.sa_handler = SIG_DFL};
+  sigemptyset(&act.sa_mask);
+  for (size_t i = 0; i < sizeof(spawn_sigdfl) / sizeof(int); i++)
+    sigaction(spawn_sigdfl[i], &act, NULL);
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigprocmask(SIG_SETMASK, &set, NULL);
+
+  execcmd(cmd, argv);
+  spawn_errno = errno;
+  _exit(errno == ENOENT ? 127 : 126);
+}
+
+/* Start external command `cmd` found by `findcmd` in a new process that joins
+ * process group `pgid` (or creates a new one if zero). File descriptors
+ * `input` and `output` (if not -1) become standard input and output of the
+ * process. Returns pid of the process, which has already called execve or
+ * exited if it failed. */
+pid_t spawn(pid_t pgid, int input, int output, cmdent_t *cmd, char **argv,
+            bool bg) {
+  spawn_errno = 0;
+
+  sigset_t all, mask;
+  sigfillset(&all);
+  Sigprocmask(SIG_SETMASK, &all, &mask);
+
+  pid_t pid = vfork();
+  if (pid == 0)
+    spawn_child(pgid, input, output, cmd, argv, bg);
+
+  int error = pid < 0 ? errno : spawn_errno;
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  if (pid < 0) {
+    errno = error;
+    unix_error("Vfork error");
+  }
+
+  if (error)
+    msg("%s: %s\n", argv[0], strerror(error));
+
+  return pid;
+}